@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "HostSupport.hpp"
+#include "WMIArgumentCache.hpp"
+
+/*
+ * Hammers the argument cache the way the controller's call paths use it,
+ * copy and release per call, and checks that after warm-up no call
+ * allocates and nothing is left behind. --iterations N runs longer.
+ */
+
+/* An OSNumber with counted allocations and references */
+class CountedNumber {
+    int references = 1;
+
+ public:
+    static long live;
+    static long allocations;
+
+    UInt64 value;
+
+    static CountedNumber* withNumber(unsigned long long value, unsigned int bits) {
+        CountedNumber* number = new CountedNumber;
+        number->value = value;
+        live++;
+        allocations++;
+        return number;
+    }
+
+    void retain() { references++; }
+    void release() {
+        if (--references == 0) {
+            live--;
+            delete this;
+        }
+    }
+    int getReferences() const { return references; }
+};
+
+long CountedNumber::live = 0;
+long CountedNumber::allocations = 0;
+
+/* One call of each kind, like setEventEnable, queryBlock, evaluateMethod and getEventData do */
+static void call(WMIArgumentCache<CountedNumber>* cache, const WMIBlock* block, long i) {
+    CountedNumber* flag = cache->copyFlag(i & 1);
+    CountedNumber* instance = cache->copyInstance((UInt8) (i % block->instanceCount));
+    CountedNumber* method = cache->copyMethod((UInt32) (i % WMI_CACHED_METHOD_IDS));
+    CHECK(flag->value == (UInt64) (i & 1));
+    CHECK(method->value == (UInt64) (i % WMI_CACHED_METHOD_IDS));
+    flag->release();
+    instance->release();
+    method->release();
+    if (block->flags & ACPI_WMI_EVENT) {
+        CountedNumber* notify = cache->copyNotify(block->notifyId);
+        CHECK(notify->value == block->notifyId);
+        notify->release();
+    }
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 2 && strcmp(argv[1], "--iterations") == 0 ? atol(argv[2]) : 5000000;
+
+    std::vector<WMIBlock> blocks = makeBlocks(64);
+    WMIBlockTable table;
+    CHECK(table.load(blocks.data(), (UInt32) (blocks.size() * sizeof(WMIBlock))));
+
+    WMIArgumentCache<CountedNumber> cache;
+    CHECK(cache.init(table));
+    for (long i = 0; i < 1000; i++) {
+        call(&cache, table.getBlock((int) (i % table.getCount())), i);
+    }
+
+    long liveNumbers = CountedNumber::live;
+    long allocatedNumbers = CountedNumber::allocations;
+    long liveBlocks = wmiLiveAllocations;
+    long allocatedBlocks = wmiTotalAllocations;
+    for (long i = 0; i < iterations; i++) {
+        call(&cache, table.getBlock((int) (i % table.getCount())), i);
+    }
+    printf("%ld calls: %ld numbers allocated, %ld blocks allocated, %ld numbers live\n",
+           iterations, CountedNumber::allocations - allocatedNumbers,
+           wmiTotalAllocations - allocatedBlocks, CountedNumber::live - liveNumbers);
+    CHECK(CountedNumber::allocations == allocatedNumbers);
+    CHECK(CountedNumber::live == liveNumbers);
+    CHECK(wmiTotalAllocations == allocatedBlocks);
+    CHECK(wmiLiveAllocations == liveBlocks);
+
+    // Every shared argument is back to the cache's own reference
+    CountedNumber* flag = cache.copyFlag(true);
+    CHECK(flag->getReferences() == 2);
+    flag->release();
+
+    // Uncommon values are allocated per call, and released again
+    for (long i = 0; i < 1000; i++) {
+        CountedNumber* instance = cache.copyInstance(200);
+        CountedNumber* notify = cache.copyNotify(0x10);
+        CountedNumber* method = cache.copyMethod(0x10000);
+        CHECK(instance->value == 200 && notify->value == 0x10 && method->value == 0x10000);
+        instance->release();
+        notify->release();
+        method->release();
+    }
+    CHECK(CountedNumber::live == liveNumbers);
+
+    cache.free();
+    table.unload();
+    CHECK(CountedNumber::live == 0);
+    CHECK(wmiLiveAllocations == 0);
+
+    if (checkFailures) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    return 0;
+}
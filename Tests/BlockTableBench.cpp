@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include <array>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include "HostSupport.hpp"
+#include "MockACPIDevice.hpp"
+
+/*
+ * Cost of the controller core against the mock device at different _WDG
+ * sizes. Run with --quick for a smoke run, as ctest does.
+ */
+
+static long handlerCalls = 0;
+
+/* findBlock before the GUID index: format every block's GUID and compare */
+static const WMIBlock* findByScan(const std::vector<WMIBlock>& blocks, const char* guid) {
+    for (const WMIBlock& block : blocks) {
+        char matchingGuid[37];
+        wmi_gtoa(block.guid, matchingGuid);
+        if (strcmp(guid, matchingGuid) == 0) {
+            return &block;
+        }
+    }
+    return nullptr;
+}
+
+static void onEvent(OSObject* target, WMIBlock* block, const WMIEventData* eventData) {
+    handlerCalls++;
+}
+
+/*
+ * Stand-in for the OSSymbol::withCString that evaluateObject(const char*)
+ * runs on every call: a locked lookup in the global symbol pool.
+ */
+class SymbolPool {
+    std::mutex lock;
+    std::unordered_set<std::string> symbols;
+
+ public:
+    const std::string* intern(const char* name) {
+        std::lock_guard<std::mutex> guard(lock);
+        return &*symbols.insert(name).first;
+    }
+};
+
+/* WQxx and WExx calls naming the method per call as before, and with the names built at load */
+static void runMethodCalls(const std::vector<WMIBlock>& blocks, MockACPIDevice* device, long iterations) {
+    int blockCount = (int) blocks.size();
+    std::vector<int> dataBlocks, eventBlocks;
+    std::vector<std::array<char, 5>> names(blockCount);
+    for (int i = 0; i < blockCount; i++) {
+        bool event = blocks[i].flags & ACPI_WMI_EVENT;
+        WMIBlockTable::getMethodName(&blocks[i], event ? kWMIMethodEventEnable : kWMIMethodQuery, names[i].data());
+        device->setInteger(names[i].data(), 0, i);
+        (event ? eventBlocks : dataBlocks).push_back(i);
+    }
+
+    SymbolPool pool;
+    WMIEventData result;
+    UInt32 argument = 0;
+    double before = benchmark("WQxx call, name per call (old)", blockCount, iterations, [&](long i) {
+        const WMIBlock* block = &blocks[dataBlocks[i % dataBlocks.size()]];
+        char methodName[5] = {0};
+        strncpy(methodName, "WQ", 2);
+        strncat(methodName, block->objectId, 2);
+        pool.intern(methodName);
+        device->evaluate(methodName, &argument, 1, &result);
+        device->release(&result);
+    });
+    double after = benchmark("WQxx call, prebuilt name", blockCount, iterations, [&](long i) {
+        device->evaluate(names[dataBlocks[i % dataBlocks.size()]].data(), &argument, 1, &result);
+        device->release(&result);
+    });
+    printf("%-32s %4d blocks %12.1f ns/op saved\n", "WQxx per-call cost", blockCount, before - after);
+
+    before = benchmark("WExx call, name per call (old)", blockCount, iterations, [&](long i) {
+        const WMIBlock* block = &blocks[eventBlocks[i % eventBlocks.size()]];
+        char methodName[5] = {0};
+        snprintf(methodName, 5, "WE%02X", block->notifyId);
+        pool.intern(methodName);
+        device->evaluate(methodName, &argument, 1, &result);
+        device->release(&result);
+    });
+    after = benchmark("WExx call, prebuilt name", blockCount, iterations, [&](long i) {
+        device->evaluate(names[eventBlocks[i % eventBlocks.size()]].data(), &argument, 1, &result);
+        device->release(&result);
+    });
+    printf("%-32s %4d blocks %12.1f ns/op saved\n", "WExx per-call cost", blockCount, before - after);
+}
+
+static void runBlockCount(int blockCount, long iterations) {
+    std::vector<WMIBlock> blocks = makeBlocks(blockCount);
+    MockACPIDevice device;
+    device.setBlocks(blocks);
+    for (int i = 0; i < blockCount; i += 4) {
+        device.setInteger("_WED", blocks[i].notifyId, i);
+    }
+
+    WMIBlockTable table;
+    benchmark("loadBlocks", blockCount, iterations / blockCount + 1, [&](long i) {
+        table.load(&device);
+        table.unload();
+    });
+
+    table.load(&device);
+    std::vector<WMIGuid> guids;
+    std::vector<std::string> strings;
+    for (const WMIBlock& block : blocks) {
+        char string[37];
+        wmi_gtoa(block.guid, string);
+        guids.push_back(WMIGuid::fromRaw(block.guid));
+        strings.push_back(string);
+    }
+    double scan = benchmark("findBlock, string scan (old)", blockCount, iterations / 10 + 1, [&](long i) {
+        if (!findByScan(blocks, strings[i % blockCount].c_str())) {
+            abort();
+        }
+    });
+    double parsed = benchmark("findBlock, parse + index", blockCount, iterations, [&](long i) {
+        if (!table.find(WMIGuid::parse(strings[i % blockCount].c_str()))) {
+            abort();
+        }
+    });
+    benchmark("findBlock, WMIGuid + index", blockCount, iterations, [&](long i) {
+        if (!table.find(guids[i % blockCount])) {
+            abort();
+        }
+    });
+    printf("%-32s %4d blocks %12.1fx\n", "findBlock speedup (string API)", blockCount, scan / parsed);
+
+    WMISubscriberList* list = WMIBlockTable::allocSubscribers(1);
+    list->handlers[0] = {nullptr, onEvent};
+    table.publishSubscribers(0, list);
+    UInt8 subscribed = blocks[0].notifyId;
+    benchmark("message, subscribed", blockCount, iterations, [&](long i) {
+        table.dispatchNotify(&device, subscribed);
+    });
+    UInt8 unsubscribed = blocks[blockCount > 4 ? 4 : 0].notifyId;
+    if (unsubscribed != subscribed) {
+        benchmark("message, no subscriber", blockCount, iterations, [&](long i) {
+            table.dispatchNotify(&device, unsubscribed);
+        });
+    }
+    table.unload();
+
+    runMethodCalls(blocks, &device, iterations);
+}
+
+int main(int argc, char** argv) {
+    bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+    long iterations = quick ? 10000 : 2000000;
+
+    for (int blockCount : {8, 64, 256}) {
+        runBlockCount(blockCount, iterations);
+    }
+    return handlerCalls ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+#include <array>
+#include "HostSupport.hpp"
+#include "MockACPIDevice.hpp"
+#include "HotkeyTable.hpp"
+
+struct Received {
+    int calls = 0;
+    WMIBlock* block = nullptr;
+    WMIEventData eventData = {};
+};
+
+static void onEvent(OSObject* target, WMIBlock* block, const WMIEventData* eventData) {
+    Received* received = reinterpret_cast<Received*>(target);
+    received->calls++;
+    received->block = block;
+    received->eventData = *eventData;
+}
+
+static void subscribe(WMIBlockTable* table, int index, Received* received) {
+    WMISubscriberList* list = WMIBlockTable::allocSubscribers(1);
+    list->handlers[0].target = reinterpret_cast<OSObject*>(received);
+    list->handlers[0].action = onEvent;
+    table->publishSubscribers(index, list);
+}
+
+static void testLoad() {
+    std::vector<WMIBlock> blocks = makeBlocks(64);
+    MockACPIDevice device;
+    device.setBlocks(blocks);
+
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    CHECK(table.getCount() == 64);
+    CHECK(device.getOutstanding() == 0);
+    for (const WMIBlock& block : blocks) {
+        WMIBlock* found = table.find(WMIGuid::fromRaw(block.guid));
+        CHECK(found && memcmp(found->guid, block.guid, 16) == 0 && found->flags == block.flags);
+    }
+    CHECK(!table.find(WMIGuid::fromRaw(makeBlocks(1, 99)[0].guid)));
+    CHECK(!table.find(WMIGuid::parse("not a guid")));
+
+    int guids = 0;
+    table.forEachGuid([&](int index) { guids++; });
+    CHECK(guids == 64);
+
+    table.unload();
+    CHECK(table.getCount() == 0);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+static void testMalformedWDG() {
+    MockACPIDevice device;
+    WMIBlockTable table;
+    CHECK(!table.load(&device));
+
+    char truncated[sizeof(WMIBlock) + 4] = {};
+    device.setBuffer("_WDG", truncated, sizeof(truncated));
+    CHECK(!table.load(&device));
+    CHECK(table.getCount() == 0);
+
+    device.setBuffer("_WDG", truncated, 0);
+    CHECK(!table.load(&device));
+    CHECK(device.getOutstanding() == 0);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* The first of several blocks with the same GUID or notify ID wins */
+static void testDuplicates() {
+    std::vector<WMIBlock> blocks = makeBlocks(8);
+    blocks[5] = blocks[4];
+    blocks[5].objectId[0] = 'Z';
+    blocks[4].flags = ACPI_WMI_EVENT;
+    blocks[4].notifyId = 0xD0;
+    blocks[0].notifyId = 0xD0;
+    MockACPIDevice device;
+    device.setBlocks(blocks);
+
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    CHECK(table.find(WMIGuid::fromRaw(blocks[5].guid)) == table.getBlock(4));
+    CHECK(table.findNotify(0xD0) == 0);
+    table.unload();
+}
+
+static void testMethodNames() {
+    WMIBlock event = {};
+    event.flags = ACPI_WMI_EVENT;
+    event.notifyId = 0xD2;
+    WMIBlock data = {};
+    data.objectId[0] = 'A';
+    data.objectId[1] = 'B';
+    WMIBlock method = data;
+    method.flags = ACPI_WMI_METHOD;
+
+    char name[5];
+    CHECK(WMIBlockTable::getMethodName(&event, kWMIMethodEventEnable, name) && strcmp(name, "WED2") == 0);
+    CHECK(!WMIBlockTable::getMethodName(&event, kWMIMethodQuery, name));
+    CHECK(!WMIBlockTable::getMethodName(&event, kWMIMethod, name));
+    CHECK(WMIBlockTable::getMethodName(&data, kWMIMethodQuery, name) && strcmp(name, "WQAB") == 0);
+    CHECK(WMIBlockTable::getMethodName(&data, kWMIMethodSet, name) && strcmp(name, "WSAB") == 0);
+    CHECK(WMIBlockTable::getMethodName(&data, kWMIMethodCollectEnable, name) && strcmp(name, "WCAB") == 0);
+    CHECK(!WMIBlockTable::getMethodName(&data, kWMIMethod, name));
+    CHECK(WMIBlockTable::getMethodName(&method, kWMIMethod, name) && strcmp(name, "WMAB") == 0);
+    CHECK(!WMIBlockTable::getMethodName(&method, kWMIMethodCollectEnable, name));
+    CHECK(!WMIBlockTable::getMethodName(&method, kWMIMethodEventEnable, name));
+}
+
+/* The names the controller interns at load match what every call used to build */
+static void testMethodNamesMatchLegacy() {
+    static const char* prefixes[] = {"WE", "WC", "WQ", "WS", "WM"};
+    for (const WMIBlock& block : makeBlocks(256)) {
+        for (int kind = kWMIMethodEventEnable; kind <= kWMIMethod; kind++) {
+            char name[5];
+            if (!WMIBlockTable::getMethodName(&block, (WMIMethodKind) kind, name)) {
+                continue;
+            }
+            char legacy[5] = {0};
+            if (kind == kWMIMethodEventEnable) {
+                snprintf(legacy, 5, "WE%02X", block.notifyId);
+            } else {
+                strncpy(legacy, prefixes[kind], 2);
+                strncat(legacy, block.objectId, 2);
+            }
+            CHECK(strcmp(name, legacy) == 0);
+        }
+    }
+}
+
+/* Prebuilt names reach the scripted objects of the right blocks */
+static void testMethodCalls() {
+    std::vector<WMIBlock> blocks = makeBlocks(32);
+    MockACPIDevice device;
+    device.setBlocks(blocks);
+    for (int i = 0; i < 32; i++) {
+        char name[5];
+        if (WMIBlockTable::getMethodName(&blocks[i], kWMIMethodQuery, name)) {
+            device.setInteger(name, 0, i);
+        }
+    }
+
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    std::vector<std::array<char, 5>> queryNames(table.getCount());
+    for (int i = 0; i < table.getCount(); i++) {
+        queryNames[i][0] = '\0';
+        WMIBlockTable::getMethodName(table.getBlock(i), kWMIMethodQuery, queryNames[i].data());
+    }
+
+    int queries = 0;
+    for (int i = 0; i < table.getCount(); i++) {
+        if (!queryNames[i][0]) {
+            CHECK(table.getBlock(i)->flags & ACPI_WMI_EVENT);
+            continue;
+        }
+        UInt32 instance = 0;
+        WMIEventData result;
+        CHECK(device.evaluate(queryNames[i].data(), &instance, 1, &result) == kIOReturnSuccess);
+        CHECK(result.type == kWMIEventDataInteger && result.integer == (UInt64) i);
+        device.release(&result);
+        queries++;
+    }
+    CHECK(queries == 24);
+    CHECK(device.getOutstanding() == 0);
+    table.unload();
+}
+
+static void testDispatch() {
+    std::vector<WMIBlock> blocks = makeBlocks(16);
+    MockACPIDevice device;
+    device.setBlocks(blocks);
+    device.setInteger("_WED", 0x80, 26);
+    UInt8 buffer[24] = {1, 2, 3};
+    device.setBuffer("_WED", 0x81, buffer, sizeof(buffer));
+
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    Received first, second;
+    subscribe(&table, table.findNotify(0x80), &first);
+    subscribe(&table, table.findNotify(0x81), &second);
+
+    CHECK(table.dispatchNotify(&device, 0x80) == 0);
+    CHECK(first.calls == 1 && first.block == table.getBlock(0));
+    CHECK(first.eventData.type == kWMIEventDataInteger && first.eventData.integer == 26);
+
+    CHECK(table.dispatchNotify(&device, 0x81) == 4);
+    CHECK(second.calls == 1 && second.eventData.type == kWMIEventDataBuffer && second.eventData.length == sizeof(buffer));
+    CHECK(device.getEvaluations("_WED") == 2);
+
+    // Nobody listens or no such block: _WED is not evaluated
+    CHECK(table.dispatchNotify(&device, 0x82) == 8);
+    CHECK(table.dispatchNotify(&device, 0x7f) == -1);
+    CHECK(device.getEvaluations("_WED") == 2);
+
+    // A failing _WED still reaches the subscribers, without data
+    subscribe(&table, table.findNotify(0x83), &second);
+    CHECK(table.dispatchNotify(&device, 0x83) == 12);
+    CHECK(second.calls == 2 && second.eventData.type == kWMIEventDataNone);
+    CHECK(device.getOutstanding() == 0);
+
+    table.unload();
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* Event codes in whichever type the firmware reports them */
+static void testEventInteger() {
+    WMIEventData data = {};
+    data.type = kWMIEventDataInteger;
+    data.integer = 0x1234;
+    CHECK(data.toInteger() == 0x1234);
+
+    UInt8 bytes[9] = {0x34, 0x12, 0, 0, 0, 0, 0, 0x80, 1};
+    data = WMIEventData();
+    data.type = kWMIEventDataBuffer;
+    data.length = 2;
+    memcpy(data.inlineBytes, bytes, sizeof(bytes));
+    CHECK(data.toInteger() == 0x1234);
+    data.length = 8;
+    CHECK(data.toInteger() == 0x8000000000001234ULL);
+    data.length = 9;
+    CHECK(data.toInteger() == 0);
+    data.length = 0;
+    CHECK(data.toInteger() == 0);
+    data.type = kWMIEventDataString;
+    data.length = 2;
+    CHECK(data.toInteger() == 0);
+
+    data = WMIEventData();
+    data.type = kWMIEventDataPackage;
+    data.length = 3;
+    data.integer = 0xd2;
+    CHECK(data.toInteger() == 0xd2);
+}
+
+/* A hotkey reported as a 4 byte buffer finds its entry, as in onWMIEvent */
+static void testBufferPayloadHotkey() {
+    MockACPIDevice device;
+    device.setBlocks(makeBlocks(4));
+    UInt8 payload[4] = {0xd2, 0, 0, 0};
+    device.setBuffer("_WED", 0x80, payload, sizeof(payload));
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    Received received;
+    subscribe(&table, table.findNotify(0x80), &received);
+
+    HotkeyTable* hotkeys = HotkeyTable::create(1);
+    CHECK(hotkeys && hotkeys->addExact(0x80, 0xd2, 7));
+    CHECK(table.dispatchNotify(&device, 0x80) == 0);
+    CHECK(received.calls == 1 && received.eventData.type == kWMIEventDataBuffer);
+    CHECK(hotkeys->lookup(0x80, (UInt32) received.eventData.toInteger()) == 7);
+
+    HotkeyTable::free(hotkeys);
+    table.unload();
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* Records what the kext hooks see, and defers or observes as told */
+struct RecordingHooks : WMIDispatchHooks {
+    bool wantAll = false;
+    bool defer = false;
+    int eventDataCalls = 0, deferred = 0, handlerCalls = 0;
+    int lastIndex = 0;
+    IOReturn lastStatus = kIOReturnSuccess;
+
+    bool wantsEventData(UInt8 notifyId, int index) override { return wantAll; }
+    void onEventData(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status) override {
+        eventDataCalls++;
+        lastIndex = index;
+        lastStatus = status;
+    }
+    bool deferEvent(UInt8 notifyId, int index, const WMIEventData* eventData) override {
+        deferred += defer;
+        return defer;
+    }
+    void callHandler(int index, const WMIEventHandler* handler, WMIBlock* block, const WMIEventData* eventData) override {
+        handlerCalls++;
+        WMIDispatchHooks::callHandler(index, handler, block, eventData);
+    }
+};
+
+static void testDispatchHooks() {
+    MockACPIDevice device;
+    device.setBlocks(makeBlocks(8));
+    device.setInteger("_WED", 0x80, 7);
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+    Received received;
+    subscribe(&table, table.findNotify(0x80), &received);
+
+    // Subscribers go through callHandler, observers see _WED first
+    RecordingHooks hooks;
+    CHECK(table.dispatchNotify(&device, 0x80, &hooks) == 0);
+    CHECK(hooks.eventDataCalls == 1 && hooks.lastIndex == 0 && hooks.lastStatus == kIOReturnSuccess);
+    CHECK(hooks.handlerCalls == 1 && received.calls == 1 && received.eventData.integer == 7);
+
+    // Without subscribers _WED is only evaluated if the hooks want it
+    CHECK(table.dispatchNotify(&device, 0x81, &hooks) == 4);
+    CHECK(table.dispatchNotify(&device, 0x7f, &hooks) == -1);
+    CHECK(hooks.eventDataCalls == 1 && device.getEvaluations("_WED") == 1);
+    hooks.wantAll = true;
+    CHECK(table.dispatchNotify(&device, 0x81, &hooks) == 4);
+    CHECK(table.dispatchNotify(&device, 0x7f, &hooks) == -1);
+    CHECK(hooks.eventDataCalls == 3 && hooks.lastIndex == -1 && hooks.handlerCalls == 1);
+
+    // A deferred event reaches the subscribers only through deliverEvent
+    hooks.defer = true;
+    CHECK(table.dispatchNotify(&device, 0x80, &hooks) == 0);
+    CHECK(hooks.deferred == 1 && received.calls == 1);
+    WMIEventData queued = {};
+    queued.type = kWMIEventDataInteger;
+    queued.integer = 9;
+    table.deliverEvent(0, &queued, &hooks);
+    CHECK(hooks.handlerCalls == 2 && received.calls == 2 && received.eventData.integer == 9);
+    CHECK(device.getOutstanding() == 0);
+
+    table.unload();
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* Unsubscribes from inside the handler, as a racing unregisterWMIEvent would */
+struct Retiring {
+    WMIBlockTable* table;
+    int index;
+    bool dispatching;
+};
+
+static void onEventRetire(OSObject* target, WMIBlock* block, const WMIEventData* eventData) {
+    Retiring* retiring = reinterpret_cast<Retiring*>(target);
+    retiring->dispatching = retiring->table->isDispatching();
+    retiring->table->publishSubscribers(retiring->index, nullptr);
+}
+
+/* A snapshot unpublished during dispatch outlives the dispatch, then goes */
+static void testRetireDuringDispatch() {
+    MockACPIDevice device;
+    device.setBlocks(makeBlocks(4));
+    WMIBlockTable table;
+    CHECK(table.load(&device));
+
+    Retiring retiring = {&table, table.findNotify(0x80), false};
+    WMISubscriberList* list = WMIBlockTable::allocSubscribers(1);
+    list->handlers[0].target = reinterpret_cast<OSObject*>(&retiring);
+    list->handlers[0].action = onEventRetire;
+    table.publishSubscribers(retiring.index, list);
+    long allocations = wmiLiveAllocations;
+
+    CHECK(!table.isDispatching());
+    CHECK(table.dispatchNotify(&device, 0x80) == 0);
+    CHECK(retiring.dispatching && !table.isDispatching());
+    CHECK(!table.hasSubscribers(retiring.index));
+    CHECK(wmiLiveAllocations == allocations);
+    table.reclaimSubscribers(false);
+    CHECK(wmiLiveAllocations == allocations - 1);
+
+    table.unload();
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* Notifications may arrive before _WDG is loaded and after it is gone */
+static void testUnloadedTable() {
+    MockACPIDevice device;
+    WMIBlockTable table;
+    CHECK(table.findNotify(0x80) == -1);
+    CHECK(table.dispatchNotify(&device, 0x80) == -1);
+
+    device.setBlocks(makeBlocks(4));
+    CHECK(table.load(&device));
+    CHECK(table.findNotify(0x80) == 0);
+    table.unload();
+    CHECK(table.findNotify(0x80) == -1);
+    CHECK(table.dispatchNotify(&device, 0x80) == -1);
+    CHECK(device.getEvaluations("_WED") == 0);
+}
+
+int main() {
+    testLoad();
+    testMalformedWDG();
+    testDuplicates();
+    testMethodNames();
+    testMethodNamesMatchLegacy();
+    testMethodCalls();
+    testDispatch();
+    testEventInteger();
+    testBufferPayloadHotkey();
+    testDispatchHooks();
+    testRetireDuringDispatch();
+    testUnloadedTable();
+
+    if (checkFailures) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
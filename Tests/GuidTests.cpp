@@ -0,0 +1,71 @@
+#include "HostSupport.hpp"
+
+/* Literals are parsed at compile time, in _WDG byte order */
+constexpr WMIGuid tongfangGuid = "ABBC0F72-8EA1-11D1-00A0-C90629100000"_wmiguid;
+static_assert(tongfangGuid.valid, "literal not parsed");
+static_assert(tongfangGuid.bytes[0] == 0x72 && tongfangGuid.bytes[3] == 0xAB &&
+              tongfangGuid.bytes[4] == 0xA1 && tongfangGuid.bytes[6] == 0xD1 &&
+              tongfangGuid.bytes[8] == 0x00 && tongfangGuid.bytes[15] == 0x00, "wrong byte order");
+
+static void testLiteral() {
+    const char raw[16] = {0x72, 0x0F, (char) 0xBC, (char) 0xAB, (char) 0xA1, (char) 0x8E, (char) 0xD1, 0x11,
+                          0x00, (char) 0xA0, (char) 0xC9, 0x06, 0x29, 0x10, 0x00, 0x00};
+    CHECK(tongfangGuid.compare(raw) == 0);
+    CHECK(memcmp(WMIGuid::parse("ABBC0F72-8EA1-11D1-00A0-C90629100000").bytes, tongfangGuid.bytes, 16) == 0);
+
+    char string[37];
+    wmi_gtoa(raw, string);
+    CHECK(strcmp(string, "ABBC0F72-8EA1-11D1-00A0-C90629100000") == 0);
+}
+
+/* wmi_gtoa and the parser are inverses of each other */
+static void testRoundTrip() {
+    for (int seed = 1; seed <= 16; seed++) {
+        for (const WMIBlock& block : makeBlocks(64, seed)) {
+            char string[37];
+            wmi_gtoa(block.guid, string);
+            WMIGuid guid = WMIGuid::parse(string);
+            CHECK(guid.valid && guid.compare(block.guid) == 0);
+
+            char again[37];
+            wmi_gtoa(reinterpret_cast<const char*>(guid.bytes), again);
+            CHECK(strcmp(string, again) == 0);
+
+            // Lowercase strings parse to the same GUID
+            for (char* c = string; *c; c++) {
+                if (*c >= 'A' && *c <= 'F') {
+                    *c += 'a' - 'A';
+                }
+            }
+            CHECK(WMIGuid::parse(string).compare(block.guid) == 0);
+        }
+    }
+}
+
+static void testMalformed() {
+    const char* malformed[] = {
+        "",
+        "ABBC0F72-8EA1-11D1-00A0-C9062910000",      // short
+        "ABBC0F72-8EA1-11D1-00A0-C906291000000",    // long
+        "ABBC0F728EA1-11D1-00A0-C90629100000-",     // dash moved
+        "ABBC0F72-8EA1-11D1-00A0-C9062910000X",     // not hex
+        "ABBC0F72 8EA1 11D1 00A0 C90629100000",     // no dashes
+        "{ABBC0F72-8EA1-11D1-00A0-C90629100000}",   // braces
+    };
+    for (const char* string : malformed) {
+        CHECK(!WMIGuid::parse(string).valid);
+    }
+    CHECK(!WMIGuid::parse(nullptr).valid);
+}
+
+int main() {
+    testLiteral();
+    testRoundTrip();
+    testMalformed();
+
+    if (checkFailures) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include "HostSupport.hpp"
+
+long wmiLiveAllocations = 0;
+long wmiTotalAllocations = 0;
+int checkFailures = 0;
+
+void* wmi_alloc(size_t size) {
+    void* memory = calloc(1, size);
+    if (memory) {
+        wmiLiveAllocations++;
+        wmiTotalAllocations++;
+    }
+    return memory;
+}
+
+void wmi_free(void* memory, size_t size) {
+    if (memory) {
+        wmiLiveAllocations--;
+    }
+    free(memory);
+}
+
+void* hotkey_alloc(size_t size) {
+    return wmi_alloc(size);
+}
+
+void hotkey_free(void* memory, size_t size) {
+    wmi_free(memory, size);
+}
+
+std::vector<WMIBlock> makeBlocks(int count, UInt32 seed) {
+    std::vector<WMIBlock> blocks(count);
+    UInt32 state = seed;
+    for (int i = 0; i < count; i++) {
+        WMIBlock* block = &blocks[i];
+        for (int j = 0; j < 16; j++) {
+            state = state * 1103515245u + 12345u;
+            block->guid[j] = (char) (state >> 16);
+        }
+        block->instanceCount = 1 + i % 3;
+        if (i % 4 == 0) {
+            block->flags = ACPI_WMI_EVENT;
+            block->notifyId = 0x80 + i / 4;
+            block->reserved = 0;
+        } else {
+            block->flags = i % 4 == 1 ? ACPI_WMI_METHOD : 0;
+            block->objectId[0] = 'A' + i / 26 % 26;
+            block->objectId[1] = 'A' + i % 26;
+        }
+    }
+    return blocks;
+}
@@ -0,0 +1,49 @@
+#ifndef HostSupport_hpp
+#define HostSupport_hpp
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "WMIBlockTable.hpp"
+#include "HotkeyTable.hpp"
+
+/*
+ * What the kext provides to the portable core, for host builds: the
+ * allocation hooks, counted so tests can check for leaks, plus helpers
+ * shared by the tests and benchmarks.
+ */
+
+/* Blocks currently allocated through wmi_alloc or hotkey_alloc, and allocations ever made */
+extern long wmiLiveAllocations;
+extern long wmiTotalAllocations;
+
+extern int checkFailures;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        checkFailures++; \
+    } \
+} while (0)
+
+/*
+ * A _WDG with count blocks and pseudo random GUIDs: every fourth block is
+ * an event with notify ID 0x80 + i / 4, every fourth a method, the rest
+ * data blocks, with object IDs "AA", "AB", ...
+ */
+std::vector<WMIBlock> makeBlocks(int count, UInt32 seed = 1);
+
+/* Run f iterations times, print and return the average cost in ns */
+template <typename F>
+double benchmark(const char* name, int blockCount, long iterations, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        f(i);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double perOp = elapsed / iterations;
+    printf("%-32s %4d blocks %12.1f ns/op\n", name, blockCount, perOp);
+    return perOp;
+}
+
+#endif /* HostSupport_hpp */
@@ -0,0 +1,109 @@
+#include "HostSupport.hpp"
+
+/*
+ * HotkeyTable lookups with the order compileHotkeyTable relies on, plus
+ * their cost for hits and for keys no entry maps.
+ */
+
+static void testOrder() {
+    HotkeyTable* table = HotkeyTable::create(6);
+    CHECK(table->addExact(0x80, 5, 1));
+    CHECK(!table->addExact(0x80, 5, 2));
+    CHECK(table->addPredicate(0x80, 0xffffffff, 1, 10, 3));   // expanded
+    CHECK(table->addExact(0x80, 7, 4));                       // replaces an expanded value
+    CHECK(table->addPredicate(0x80, 0xffffffff, 8, 12, 5));   // 8 to 10 taken already
+    CHECK(table->addPredicate(0x81, 0xff00, 0x100, 0x300, 6));
+
+    CHECK(table->lookup(0x80, 5) == 1);
+    CHECK(table->lookup(0x80, 1) == 3 && table->lookup(0x80, 10) == 3);
+    CHECK(table->lookup(0x80, 7) == 4);
+    CHECK(table->lookup(0x80, 11) == 5 && table->lookup(0x80, 12) == 5);
+    CHECK(table->lookup(0x80, 13) == HOTKEY_NO_ACTION);
+    CHECK(table->lookup(0x81, 0x2ff) == 6 && table->lookup(0x81, 0x4ff) == HOTKEY_NO_ACTION);
+    CHECK(table->lookup(0x82, 5) == HOTKEY_NO_ACTION);
+    CHECK(table->predicateCount == 1);
+    HotkeyTable::free(table);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* A predicate that is not expanded keeps later ranges of its notify ID from jumping ahead of it */
+static void testPredicateBeforeRange() {
+    HotkeyTable* table = HotkeyTable::create(3);
+    CHECK(table->addPredicate(0x80, 0xf0, 0x10, 0x10, 1));
+    CHECK(table->addPredicate(0x80, 0xffffffff, 0x18, 0x20, 2));
+    CHECK(table->addPredicate(0x81, 0xffffffff, 0x18, 0x20, 3));
+    CHECK(table->lookup(0x80, 0x18) == 1 && table->lookup(0x80, 0x20) == 2);
+    CHECK(table->lookup(0x81, 0x18) == 3);
+    CHECK(table->predicateCount == 2);
+
+    // Wide ranges stay predicates
+    CHECK(table->addPredicate(0x82, 0xffffffff, 0, HOTKEY_EXPAND_LIMIT, 4));
+    CHECK(table->predicateCount == 3 && table->lookup(0x82, HOTKEY_EXPAND_LIMIT) == 4);
+    HotkeyTable::free(table);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* Expansion grows the hash past what create() sized it for */
+static void testGrowth() {
+    HotkeyTable* table = HotkeyTable::create(4);
+    for (UInt8 notifyId = 0x80; notifyId < 0x84; notifyId++) {
+        CHECK(table->addPredicate(notifyId, 0xffffffff, 0, HOTKEY_EXPAND_LIMIT - 1, notifyId & 0xf));
+    }
+    CHECK(table->exactCount == 4 * HOTKEY_EXPAND_LIMIT && table->slotCount >= 2 * table->exactCount);
+    for (UInt8 notifyId = 0x80; notifyId < 0x84; notifyId++) {
+        for (UInt32 value = 0; value < HOTKEY_EXPAND_LIMIT; value++) {
+            CHECK(table->lookup(notifyId, value) == (notifyId & 0xf));
+        }
+        CHECK(table->lookup(notifyId, HOTKEY_EXPAND_LIMIT) == HOTKEY_NO_ACTION);
+    }
+    HotkeyTable::free(table);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/*
+ * A scheme of 16 exact keys and 16 ranges of 8 values on one notify ID,
+ * plus masked predicates on another. Hits and misses of the first stay
+ * O(1), a miss on the second walks its predicates.
+ */
+static void benchLookup() {
+    HotkeyTable* table = HotkeyTable::create(64);
+    for (UInt32 i = 0; i < 16; i++) {
+        table->addExact(0x80, i, (UInt8) i);
+        table->addPredicate(0x80, 0xffffffff, 0x100 + 8 * i, 0x107 + 8 * i, (UInt8) (0x10 + i));
+        table->addPredicate(0x81, 0xff00, 0x1000 + 0x100 * i, 0x1000 + 0x100 * i, (UInt8) (0x20 + i));
+    }
+
+    long found = 0;
+    benchmark("hotkey lookup, exact", 16, 1000000, [&](long i) {
+        found += table->lookup(0x80, (UInt32) (i & 15)) != HOTKEY_NO_ACTION;
+    });
+    benchmark("hotkey lookup, range", 16, 1000000, [&](long i) {
+        found += table->lookup(0x80, (UInt32) (0x100 + (i & 127))) != HOTKEY_NO_ACTION;
+    });
+    benchmark("hotkey lookup, unmapped", 16, 1000000, [&](long i) {
+        found += table->lookup(0x80, (UInt32) (0x1000 + (i & 127))) != HOTKEY_NO_ACTION;
+    });
+    benchmark("hotkey lookup, masked hit", 16, 1000000, [&](long i) {
+        found += table->lookup(0x81, (UInt32) (0x1000 + ((i & 15) << 8))) != HOTKEY_NO_ACTION;
+    });
+    benchmark("hotkey lookup, masked miss", 16, 1000000, [&](long i) {
+        found += table->lookup(0x81, (UInt32) (0x2000 + (i & 127))) != HOTKEY_NO_ACTION;
+    });
+    CHECK(found == 3 * 1000000);
+
+    HotkeyTable::free(table);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+int main() {
+    testOrder();
+    testPredicateBeforeRange();
+    testGrowth();
+    benchLookup();
+
+    if (checkFailures) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+#include "WMIGuid.hpp"
+
+/*
+ * Must not build: a malformed literal used outside a constant expression.
+ * The MalformedGuidLiteral test expects the compiler to reject it.
+ */
+bool isMalformedLiteral(const WMIGuid& guid) {
+    return guid.compare(reinterpret_cast<const char*>(("ABBC0F72-8EA1-11D1-00A0-C9062910000X"_wmiguid).bytes)) == 0;
+}
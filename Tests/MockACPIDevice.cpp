@@ -0,0 +1,75 @@
+#include "MockACPIDevice.hpp"
+
+UInt32 MockACPIDevice::packName(const char* name) {
+    UInt32 packed = 0;
+    for (int i = 0; i < 4 && name[i]; i++) {
+        packed |= (UInt32) (UInt8) name[i] << (i * 8);
+    }
+    return packed;
+}
+
+UInt64 MockACPIDevice::makeKey(const char* name, const UInt32* arguments, int argumentCount) {
+    return (UInt64) packName(name) << 32 | (argumentCount ? arguments[0] : 0);
+}
+
+MockACPIDevice::Response* MockACPIDevice::addResponse(const char* name, UInt32 argument) {
+    Response* response = &responses[makeKey(name, &argument, 1)];
+    response->data = WMIEventData();
+    response->bytes.clear();
+    return response;
+}
+
+void MockACPIDevice::setBlocks(const std::vector<WMIBlock>& blocks) {
+    setBuffer("_WDG", blocks.data(), (UInt32) (blocks.size() * sizeof(WMIBlock)));
+}
+
+void MockACPIDevice::setInteger(const char* name, UInt32 argument, UInt64 value) {
+    Response* response = addResponse(name, argument);
+    response->data.type = kWMIEventDataInteger;
+    response->data.integer = value;
+}
+
+void MockACPIDevice::setBuffer(const char* name, const void* bytes, UInt32 length) {
+    Response* response = addResponse(name, 0);
+    response->bytes.assign((const UInt8*) bytes, (const UInt8*) bytes + length);
+}
+
+void MockACPIDevice::setBuffer(const char* name, UInt32 argument, const void* bytes, UInt32 length) {
+    Response* response = addResponse(name, argument);
+    response->bytes.assign((const UInt8*) bytes, (const UInt8*) bytes + length);
+}
+
+long MockACPIDevice::getEvaluations(const char* name) const {
+    auto it = evaluations.find(packName(name));
+    return it == evaluations.end() ? 0 : it->second;
+}
+
+IOReturn MockACPIDevice::evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) {
+    evaluations[packName(name)]++;
+    *result = WMIEventData();
+
+    auto it = responses.find(makeKey(name, arguments, argumentCount));
+    if (it == responses.end()) {
+        return kIOReturnNotFound;
+    }
+    Response* response = &it->second;
+    *result = response->data;
+    if (!response->bytes.empty() || response->data.type == kWMIEventDataNone) {
+        result->type = kWMIEventDataBuffer;
+        result->length = (UInt32) response->bytes.size();
+        if (result->length <= WMI_EVENT_INLINE_SIZE) {
+            memcpy(result->inlineBytes, response->bytes.data(), result->length);
+        } else {
+            result->externalBytes = response->bytes.data();
+        }
+    }
+    outstanding++;
+    return kIOReturnSuccess;
+}
+
+void MockACPIDevice::release(WMIEventData* result) {
+    if (result->type != kWMIEventDataNone) {
+        outstanding--;
+    }
+    *result = WMIEventData();
+}
@@ -0,0 +1,47 @@
+#ifndef MockACPIDevice_hpp
+#define MockACPIDevice_hpp
+
+#include <unordered_map>
+#include <vector>
+#include "WMIBlockTable.hpp"
+
+/*
+ * Stands in for the IOACPIPlatformDevice of the controller. It serves a
+ * scripted _WDG and scripted WQxx, WMxx and _WED results, keyed by object
+ * name and first argument (0 without arguments), and counts what is
+ * evaluated. Evaluating never
+ * allocates once the script is set up, so benchmarks measure the caller.
+ */
+class MockACPIDevice : public WMIDevice {
+    struct Response {
+        WMIEventData data;
+        std::vector<UInt8> bytes;
+    };
+
+    std::unordered_map<UInt64, Response> responses;
+    std::unordered_map<UInt32, long> evaluations;
+    long outstanding = 0;
+
+    static UInt32 packName(const char* name);
+    static UInt64 makeKey(const char* name, const UInt32* arguments, int argumentCount);
+    Response* addResponse(const char* name, UInt32 argument);
+
+ public:
+    /* Serve blocks as the _WDG buffer */
+    void setBlocks(const std::vector<WMIBlock>& blocks);
+
+    /* Answer name(argument, ...) with a value, the overload without argument answers name() */
+    void setInteger(const char* name, UInt32 argument, UInt64 value);
+    void setBuffer(const char* name, const void* bytes, UInt32 length);
+    void setBuffer(const char* name, UInt32 argument, const void* bytes, UInt32 length);
+
+    /* Evaluations of an object so far, unscripted ones included */
+    long getEvaluations(const char* name) const;
+    /* Results handed out and not released yet */
+    long getOutstanding() const { return outstanding; }
+
+    IOReturn evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) override;
+    void release(WMIEventData* result) override;
+};
+
+#endif /* MockACPIDevice_hpp */
@@ -0,0 +1,128 @@
+#include <string.h>
+#include <algorithm>
+#include "HostSupport.hpp"
+#include "SchemeIndex.hpp"
+
+/*
+ * findScheme against indices built the way compile_schemes.py does, plus
+ * its cost with few and many schemes for the same controller.
+ */
+
+/* schemes[i] lists the GUIDs scheme i requires */
+static std::vector<SchemeIndexEntry> makeIndex(const std::vector<std::vector<WMIGuid>>& schemes) {
+    std::vector<SchemeIndexEntry> index;
+    for (size_t scheme = 0; scheme < schemes.size(); scheme++) {
+        for (const WMIGuid& guid : schemes[scheme]) {
+            SchemeIndexEntry entry = {};
+            memcpy(entry.guid, guid.bytes, 16);
+            entry.scheme = (UInt16) scheme;
+            entry.required = (UInt8) schemes[scheme].size();
+            index.push_back(entry);
+        }
+    }
+    std::sort(index.begin(), index.end(), [](const SchemeIndexEntry& a, const SchemeIndexEntry& b) {
+        int order = memcmp(a.guid, b.guid, 16);
+        return order < 0 || (order == 0 && a.scheme < b.scheme);
+    });
+    return index;
+}
+
+/* The sorted, distinct GUIDs getBlockGuids hands out */
+static std::vector<WMIGuid> controllerGuids(const std::vector<WMIBlock>& blocks) {
+    std::vector<WMIGuid> guids;
+    for (const WMIBlock& block : blocks) {
+        guids.push_back(WMIGuid::fromRaw(block.guid));
+    }
+    std::sort(guids.begin(), guids.end(), [](const WMIGuid& a, const WMIGuid& b) {
+        return memcmp(a.bytes, b.bytes, 16) < 0;
+    });
+    return guids;
+}
+
+static int match(const std::vector<SchemeIndexEntry>& index, const std::vector<WMIGuid>& guids) {
+    return findScheme(index.data(), (int) index.size(), guids.data(), (int) guids.size());
+}
+
+static void testMatch() {
+    std::vector<WMIGuid> present = controllerGuids(makeBlocks(8));
+    std::vector<WMIBlock> other = makeBlocks(4, 7);
+    WMIGuid absent = WMIGuid::fromRaw(other[0].guid);
+    WMIGuid alsoAbsent = WMIGuid::fromRaw(other[1].guid);
+
+    // A single GUID, only when present
+    CHECK(match(makeIndex({{present[3]}}), present) == 0);
+    CHECK(match(makeIndex({{absent}}), present) == -1);
+
+    // Every GUID of a multi-GUID criterion has to be present
+    CHECK(match(makeIndex({{present[1], present[5]}}), present) == 0);
+    CHECK(match(makeIndex({{present[1], absent}}), present) == -1);
+
+    // The most specific match wins, whatever the order of the schemes
+    CHECK(match(makeIndex({{present[2]}, {present[2], present[6]}, {present[2], absent}}), present) == 1);
+    CHECK(match(makeIndex({{present[2], present[6], present[7]}, {present[2]}}), present) == 0);
+
+    // Equally specific matches go to the lowest index
+    CHECK(match(makeIndex({{absent}, {present[0]}, {present[4]}}), present) == 1);
+
+    // Schemes sharing GUIDs with the controller without matching
+    CHECK(match(makeIndex({{present[0], absent}, {present[0], alsoAbsent}, {absent, alsoAbsent}}), present) == -1);
+
+    // Nothing to match
+    CHECK(match(makeIndex({}), present) == -1);
+    CHECK(match(makeIndex({{present[0]}}), {}) == -1);
+    CHECK(wmiLiveAllocations == 0);
+}
+
+/* The values compile_schemes.py's fold_digest gives */
+static void testDigest() {
+    CHECK(foldSchemeDigest(SCHEME_DIGEST_SEED, "") == 0x050c5d1f);
+    UInt32 digest = foldSchemeDigest(SCHEME_DIGEST_SEED, "Tongfang");
+    CHECK(foldSchemeDigest(digest, "ABBC0F6A-8EA1-11D1-00A0-C90629100000") == 0xfdd2f811);
+
+    // The NUL keeps moved boundaries between strings apart
+    UInt32 split = foldSchemeDigest(foldSchemeDigest(SCHEME_DIGEST_SEED, "Tong"), "fang");
+    CHECK(split != digest);
+}
+
+/*
+ * The machine has 16 GUIDs, one scheme matches two of them and the other
+ * schemes require GUIDs of other machines. Cost follows the schemes that
+ * share a GUID with the machine, held at 32 here, not their total.
+ */
+static void benchScale() {
+    std::vector<WMIBlock> blocks = makeBlocks(16);
+    std::vector<WMIGuid> present = controllerGuids(blocks);
+    for (int schemeCount : {16, 1024, 65535}) {
+        std::vector<WMIBlock> foreign = makeBlocks(schemeCount, 11);
+        std::vector<std::vector<WMIGuid>> schemes;
+        for (int i = 0; i < schemeCount - 1; i++) {
+            schemes.push_back({WMIGuid::fromRaw(foreign[i].guid)});
+            if (i < 32) {
+                schemes.back().push_back(present[i % 16]);
+            }
+        }
+        schemes.push_back({present[3], present[9]});
+        std::vector<SchemeIndexEntry> index = makeIndex(schemes);
+
+        char name[64];
+        snprintf(name, sizeof(name), "findScheme, %d schemes", schemeCount);
+        benchmark(name, (int) present.size(), 20000, [&](long i) {
+            if (match(index, present) != schemeCount - 1) {
+                checkFailures++;
+            }
+        });
+    }
+    CHECK(wmiLiveAllocations == 0);
+}
+
+int main() {
+    testMatch();
+    testDigest();
+    benchScale();
+
+    if (checkFailures) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "HostSupport.hpp"
+#include "ControllerInterface.h"
+#include "WMITrace.hpp"
+
+/*
+ * Write a trace for TraceReplay without hardware: makeBlocks(16), whose
+ * event blocks have notify IDs 0x80 to 0x83, and a scheme with
+ *
+ *     0x80  exact event data 1 to 16
+ *     0x81  masked range 0x100 to 0x300 of 0xff00
+ *     0x82  exact event data 0x50
+ *
+ * while 0x83 has no subscriber. The 4096 events, 50 us apart, cycle
+ * through the four notify IDs so that 1408 of them find an action: half
+ * of 0x80, three eighths of 0x81 and the integer half of 0x82, whose other
+ * half carries a buffer.
+ */
+
+static void addHotkey(std::vector<WMITraceHotkey>* hotkeys, const WMIBlock& block, UInt32 eventData, UInt8 actionId) {
+    WMITraceHotkey hotkey = {};
+    wmi_gtoa(block.guid, hotkey.guid);
+    hotkey.notifyId = block.notifyId;
+    hotkey.eventData = eventData;
+    hotkey.mask = 0xffffffff;
+    hotkey.actionId = actionId;
+    hotkeys->push_back(hotkey);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: SyntheticTrace trace\n");
+        return 2;
+    }
+
+    std::vector<WMIBlock> blocks = makeBlocks(16);
+    std::vector<WMITraceHotkey> hotkeys;
+    for (UInt32 i = 1; i <= 16; i++) {
+        addHotkey(&hotkeys, blocks[0], i, (UInt8) i);
+    }
+    addHotkey(&hotkeys, blocks[4], 0, 0x20);
+    hotkeys.back().isPredicate = 1;
+    hotkeys.back().mask = 0xff00;
+    hotkeys.back().first = 0x100;
+    hotkeys.back().last = 0x300;
+    addHotkey(&hotkeys, blocks[8], 0x50, 0x21);
+
+    WMITraceWriter writer;
+    if (!writer.open(argv[1], "Synthetic", blocks.data(), (uint32_t) (blocks.size() * sizeof(WMIBlock)),
+                     hotkeys.data(), (uint32_t) hotkeys.size())) {
+        fprintf(stderr, "%s: cannot write\n", argv[1]);
+        return 1;
+    }
+
+    static const UInt8 buffer[20] = {0x50};
+    for (UInt32 i = 0; i < 4096; i++) {
+        UInt8 notifyId = 0x80 + i % 4;
+        UInt32 round = i / 4;
+        UInt64 eventData;
+        switch (notifyId) {
+            case 0x80:
+                eventData = round % 32 + 1;
+                break;
+            case 0x81:
+                eventData = (round % 8) << 8;
+                break;
+            case 0x82:
+                if (round % 2) {
+                    writer.add(i * 50000ull, notifyId, kWMICapturePayloadBuffer, buffer, sizeof(buffer));
+                    continue;
+                }
+                eventData = 0x50;
+                break;
+            default:
+                eventData = round;
+                break;
+        }
+        writer.add(i * 50000ull, notifyId, kWMICapturePayloadInteger, &eventData, sizeof(eventData));
+    }
+
+    if (!writer.close() || writer.getEventCount() != 4096) {
+        fprintf(stderr, "%s: write failed\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
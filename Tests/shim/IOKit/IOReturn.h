@@ -0,0 +1,15 @@
+#ifndef IOReturn_h
+#define IOReturn_h
+
+/* The IOReturn codes the portable core uses, with their kernel values */
+typedef int IOReturn;
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn) 0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn) 0xe00002bd)
+#define kIOReturnBadArgument    ((IOReturn) 0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn) 0xe00002c7)
+#define kIOReturnOverrun        ((IOReturn) 0xe00002e8)
+#define kIOReturnNotFound       ((IOReturn) 0xe00002f0)
+
+#endif /* IOReturn_h */
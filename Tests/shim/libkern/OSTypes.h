@@ -0,0 +1,18 @@
+#ifndef OSTypes_h
+#define OSTypes_h
+
+/* The libkern integer types for host builds */
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef bool Boolean;
+
+#endif /* OSTypes_h */
@@ -0,0 +1,7 @@
+#ifndef libkern_h
+#define libkern_h
+
+/* snprintf and friends come from libc on the host */
+#include <stdio.h>
+
+#endif /* libkern_h */
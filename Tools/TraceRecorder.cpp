@@ -0,0 +1,244 @@
+/*
+ * Record the WMI notifications of this machine into a trace for
+ * TraceReplay, through the capture ring of VoodooWMIController.
+ *
+ *     sudo TraceRecorder [-t seconds] [-w wdg.bin] trace
+ *
+ * Runs until interrupted, or for the given number of seconds. The _WDG
+ * comes from the "Raw WDG" property, which the controller only publishes
+ * with DebugMode, or from -w. The hotkey scheme is the one the hotkey
+ * driver has loaded, if any.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <mach/mach_time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "ControllerInterface.h"
+#include "WMITrace.hpp"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int signal) {
+    interrupted = 1;
+}
+
+static bool getNumber(CFDictionaryRef dict, CFStringRef key, uint32_t* value) {
+    CFTypeRef number = CFDictionaryGetValue(dict, key);
+    if (!number || CFGetTypeID(number) != CFNumberGetTypeID()) {
+        return false;
+    }
+    int64_t wide;
+    CFNumberGetValue((CFNumberRef) number, kCFNumberSInt64Type, &wide);
+    *value = (uint32_t) wide;
+    return true;
+}
+
+/* The WMIEvents of the active scheme, with the checks of compileHotkeyTable */
+static std::vector<WMITraceHotkey> copyHotkeys(char platform[32]) {
+    std::vector<WMITraceHotkey> hotkeys;
+    io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("VoodooWMIHotkeyDriver"));
+    if (service == IO_OBJECT_NULL) {
+        return hotkeys;
+    }
+    CFTypeRef name = IORegistryEntryCreateCFProperty(service, CFSTR("PlatformName"), kCFAllocatorDefault, 0);
+    if (name) {
+        if (CFGetTypeID(name) == CFStringGetTypeID()) {
+            CFStringGetCString((CFStringRef) name, platform, 32, kCFStringEncodingUTF8);
+        }
+        CFRelease(name);
+    }
+    CFTypeRef scheme = IORegistryEntryCreateCFProperty(service, CFSTR("Platform"), kCFAllocatorDefault, 0);
+    IOObjectRelease(service);
+    if (!scheme) {
+        return hotkeys;
+    }
+
+    CFTypeRef events = CFGetTypeID(scheme) == CFDictionaryGetTypeID() ?
+        CFDictionaryGetValue((CFDictionaryRef) scheme, CFSTR("WMIEvents")) : nullptr;
+    for (CFIndex i = 0; events && CFGetTypeID(events) == CFArrayGetTypeID() && i < CFArrayGetCount((CFArrayRef) events); i++) {
+        CFTypeRef dict = CFArrayGetValueAtIndex((CFArrayRef) events, i);
+        if (CFGetTypeID(dict) != CFDictionaryGetTypeID()) {
+            continue;
+        }
+        WMITraceHotkey hotkey = {};
+        uint32_t notifyId, actionId;
+        CFTypeRef guid = CFDictionaryGetValue((CFDictionaryRef) dict, CFSTR("GUID"));
+        CFTypeRef range = CFDictionaryGetValue((CFDictionaryRef) dict, CFSTR("EventRange"));
+        bool hasEvent = getNumber((CFDictionaryRef) dict, CFSTR("EventData"), &hotkey.eventData);
+        bool hasMask = getNumber((CFDictionaryRef) dict, CFSTR("EventMask"), &hotkey.mask);
+        if (!guid || CFGetTypeID(guid) != CFStringGetTypeID() ||
+            !CFStringGetCString((CFStringRef) guid, hotkey.guid, sizeof(hotkey.guid), kCFStringEncodingUTF8) ||
+            !getNumber((CFDictionaryRef) dict, CFSTR("NotifyID"), &notifyId) ||
+            !getNumber((CFDictionaryRef) dict, CFSTR("ActionID"), &actionId) || (!hasEvent && !range)) {
+            fprintf(stderr, "hotkey event %ld skipped, the driver ignores it too\n", (long) i);
+            continue;
+        }
+        if (range) {
+            CFTypeRef first = CFGetTypeID(range) == CFArrayGetTypeID() && CFArrayGetCount((CFArrayRef) range) >= 2 ?
+                CFArrayGetValueAtIndex((CFArrayRef) range, 0) : nullptr;
+            CFTypeRef last = first ? CFArrayGetValueAtIndex((CFArrayRef) range, 1) : nullptr;
+            if (!first || CFGetTypeID(first) != CFNumberGetTypeID() || CFGetTypeID(last) != CFNumberGetTypeID()) {
+                fprintf(stderr, "hotkey event %ld skipped, the driver ignores it too\n", (long) i);
+                continue;
+            }
+            CFNumberGetValue((CFNumberRef) first, kCFNumberSInt32Type, &hotkey.first);
+            CFNumberGetValue((CFNumberRef) last, kCFNumberSInt32Type, &hotkey.last);
+        }
+        hotkey.notifyId = (uint8_t) notifyId;
+        hotkey.actionId = (uint8_t) actionId;
+        hotkey.isPredicate = hasMask || range;
+        if (!hasMask) {
+            hotkey.mask = 0xffffffff;
+        }
+        if (hotkey.isPredicate && !range) {
+            hotkey.first = hotkey.last = hotkey.eventData & hotkey.mask;
+        }
+        hotkeys.push_back(hotkey);
+    }
+    CFRelease(scheme);
+    return hotkeys;
+}
+
+static bool readFile(const char* path, std::vector<uint8_t>* data) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data->insert(data->end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool copyBlockTable(io_service_t controller, std::vector<uint8_t>* data) {
+    CFTypeRef raw = IORegistryEntryCreateCFProperty(controller, CFSTR("Raw WDG"), kCFAllocatorDefault, 0);
+    if (!raw) {
+        return false;
+    }
+    if (CFGetTypeID(raw) == CFDataGetTypeID()) {
+        const uint8_t* bytes = CFDataGetBytePtr((CFDataRef) raw);
+        data->assign(bytes, bytes + CFDataGetLength((CFDataRef) raw));
+    }
+    CFRelease(raw);
+    return !data->empty();
+}
+
+int main(int argc, char* argv[]) {
+    long seconds = 0;
+    const char* wdgPath = nullptr;
+    int option;
+    while ((option = getopt(argc, argv, "t:w:")) != -1) {
+        switch (option) {
+            case 't':
+                seconds = atol(optarg);
+                break;
+            case 'w':
+                wdgPath = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: TraceRecorder [-t seconds] [-w wdg.bin] trace\n");
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: TraceRecorder [-t seconds] [-w wdg.bin] trace\n");
+        return 2;
+    }
+    const char* path = argv[optind];
+
+    io_service_t controller = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("VoodooWMIController"));
+    if (controller == IO_OBJECT_NULL) {
+        fprintf(stderr, "VoodooWMIController is not running\n");
+        return 1;
+    }
+    std::vector<uint8_t> blockTable;
+    if (wdgPath ? !readFile(wdgPath, &blockTable) : !copyBlockTable(controller, &blockTable)) {
+        fprintf(stderr, "no _WDG, enable DebugMode of the controller or pass one with -w\n");
+        IOObjectRelease(controller);
+        return 1;
+    }
+    char platform[32] = {0};
+    std::vector<WMITraceHotkey> hotkeys = copyHotkeys(platform);
+
+    io_connect_t connection;
+    kern_return_t ret = IOServiceOpen(controller, mach_task_self(), 0, &connection);
+    IOObjectRelease(controller);
+    if (ret != KERN_SUCCESS) {
+        fprintf(stderr, "cannot open VoodooWMIController: 0x%x\n", ret);
+        return 1;
+    }
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+    uint64_t enable = 1;
+    if ((ret = IOConnectMapMemory64(connection, kWMIControllerMemoryCapture, mach_task_self(), &address, &size, kIOMapAnywhere)) != KERN_SUCCESS ||
+        (ret = IOConnectCallScalarMethod(connection, kWMIControllerSelectorSetCaptureMode, &enable, 1, NULL, NULL)) != KERN_SUCCESS) {
+        fprintf(stderr, "cannot start capturing, run as root: 0x%x\n", ret);
+        IOServiceClose(connection);
+        return 1;
+    }
+    const WMICaptureRing* ring = (const WMICaptureRing*) address;
+
+    WMITraceWriter writer;
+    if (!writer.open(path, platform, blockTable.data(), (uint32_t) blockTable.size(), hotkeys.data(), (uint32_t) hotkeys.size())) {
+        fprintf(stderr, "%s: cannot write\n", path);
+        interrupted = 1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    printf("recording to %s, %zu _WDG blocks, %zu hotkeys of %s\n", path, blockTable.size() / 20, hotkeys.size(),
+           platform[0] ? platform : "no scheme");
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    uint64_t deadline = seconds ? mach_absolute_time() + seconds * 1000000000ull * timebase.denom / timebase.numer : 0;
+    uint32_t position = __atomic_load_n(&ring->header.head, __ATOMIC_ACQUIRE);
+    uint64_t firstTimestamp = 0;
+    long lost = 0;
+    bool written = true;
+    while (!interrupted && written && (!deadline || mach_absolute_time() < deadline)) {
+        uint32_t head = __atomic_load_n(&ring->header.head, __ATOMIC_ACQUIRE);
+        if (head - position > WMI_CAPTURE_RECORDS) {
+            lost += head - position - WMI_CAPTURE_RECORDS;
+            position = head - WMI_CAPTURE_RECORDS;
+        }
+        for (; position != head && written; position++) {
+            const WMICaptureRecord* slot = &ring->records[position % WMI_CAPTURE_RECORDS];
+            WMICaptureRecord record;
+            uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            memcpy(&record, slot, sizeof(record));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (before != position + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != position + 1) {
+                lost++;
+                continue;
+            }
+            if (!firstTimestamp) {
+                firstTimestamp = record.timestamp;
+            }
+            uint64_t offset = (record.timestamp - firstTimestamp) * timebase.numer / timebase.denom;
+            uint16_t length = (uint16_t) (record.payloadLength < WMI_CAPTURE_PAYLOAD_SIZE ? record.payloadLength : WMI_CAPTURE_PAYLOAD_SIZE);
+            written = writer.add(offset, record.notifyId, record.payloadType, record.payload, length);
+        }
+        usleep(1000);
+    }
+
+    enable = 0;
+    IOConnectCallScalarMethod(connection, kWMIControllerSelectorSetCaptureMode, &enable, 1, NULL, NULL);
+    IOConnectUnmapMemory64(connection, kWMIControllerMemoryCapture, mach_task_self(), address);
+    IOServiceClose(connection);
+
+    uint32_t count = writer.getEventCount();
+    if (!writer.close() || !written) {
+        fprintf(stderr, "%s: write failed\n", path);
+        return 1;
+    }
+    printf("%u events recorded, %ld lost\n", count, lost);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Replay a recorded WMI trace through the portable controller core and the
+ * hotkey lookup of VoodooWMIHotkeyDriver::onWMIEvent, then report
+ * throughput and dispatch latency percentiles.
+ *
+ *     TraceReplay [--realtime] [--repeat N] [--max-p99 NS] [--expect-matches N] trace
+ *
+ * Without --realtime the events are replayed back to back, with it they
+ * keep their recorded spacing. Latency is the time dispatchNotify takes,
+ * _WED and the subscriber included. --max-p99 and --expect-matches turn
+ * the run into a check: the exit status is 1 if the p99 latency is above
+ * NS, or if the number of events that found an action, over all rounds,
+ * differs from N.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "WMIBlockTable.hpp"
+#include "HotkeyTable.hpp"
+#include "ControllerInterface.h"
+#include "WMITrace.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+/* Serves the recorded _WDG, and the recorded _WED result of the event being replayed */
+class ReplayDevice : public WMIDevice {
+    const WMITrace* trace;
+
+ public:
+    size_t current = 0;
+
+    explicit ReplayDevice(const WMITrace* trace) : trace(trace) {}
+
+    IOReturn evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) override {
+        *result = WMIEventData();
+        const void* bytes;
+        UInt32 length;
+        if (strcmp(name, "_WDG") == 0) {
+            result->type = kWMIEventDataBuffer;
+            bytes = trace->blockTable.data();
+            length = (UInt32) trace->blockTable.size();
+        } else if (strcmp(name, "_WED") == 0) {
+            const WMITraceEvent* event = &trace->events[current];
+            bytes = trace->getPayload(current);
+            length = event->payloadLength;
+            switch (event->payloadType) {
+                case kWMICapturePayloadInteger:
+                    result->type = kWMIEventDataInteger;
+                    memcpy(&result->integer, bytes, std::min<UInt32>(length, sizeof(UInt64)));
+                    return kIOReturnSuccess;
+                case kWMICapturePayloadBuffer:
+                    result->type = kWMIEventDataBuffer;
+                    break;
+                case kWMICapturePayloadString:
+                    result->type = kWMIEventDataString;
+                    break;
+                case kWMICapturePayloadOther:
+                    result->type = kWMIEventDataPackage;
+                    memcpy(&result->integer, bytes, std::min<UInt32>(length, sizeof(UInt64)));
+                    return kIOReturnSuccess;
+                default:
+                    return kIOReturnError;
+            }
+        } else {
+            return kIOReturnNotFound;
+        }
+
+        result->length = length;
+        if (length <= WMI_EVENT_INLINE_SIZE) {
+            memcpy(result->inlineBytes, bytes, length);
+        } else {
+            result->externalBytes = bytes;
+        }
+        return kIOReturnSuccess;
+    }
+
+    void release(WMIEventData* result) override {
+        *result = WMIEventData();
+    }
+};
+
+struct ReplayState {
+    const HotkeyTable* hotkeys;
+    long matches;
+    long actions[256];
+};
+
+/* What onWMIEvent does before dispatchCommand */
+static void onEvent(OSObject* target, WMIBlock* block, const WMIEventData* eventData) {
+    ReplayState* state = reinterpret_cast<ReplayState*>(target);
+    UInt32 obtainedEventData = (UInt32) eventData->toInteger();
+    UInt8 actionId = state->hotkeys->lookup(block->notifyId, obtainedEventData);
+    if (actionId != HOTKEY_NO_ACTION) {
+        state->matches++;
+        state->actions[actionId]++;
+    }
+}
+
+/* The hotkey driver registers once per GUID of its scheme */
+static bool subscribe(WMIBlockTable* table, const WMITrace& trace, ReplayState* state) {
+    for (size_t i = 0; i < trace.hotkeys.size(); i++) {
+        char guid[sizeof(trace.hotkeys[i].guid)];
+        memcpy(guid, trace.hotkeys[i].guid, sizeof(guid));
+        guid[sizeof(guid) - 1] = '\0';
+        WMIBlock* block = table->find(WMIGuid::parse(guid));
+        if (!block) {
+            fprintf(stderr, "hotkey entry %zu: GUID not in _WDG\n", i);
+            return false;
+        }
+        int index = table->getIndex(block);
+        if (table->getSubscribers(index)) {
+            continue;
+        }
+        WMISubscriberList* list = WMIBlockTable::allocSubscribers(1);
+        if (!list) {
+            return false;
+        }
+        list->handlers[0].target = reinterpret_cast<OSObject*>(state);
+        list->handlers[0].action = onEvent;
+        table->publishSubscribers(index, list);
+    }
+    return true;
+}
+
+static HotkeyTable* compileHotkeys(const WMITrace& trace) {
+    HotkeyTable* table = HotkeyTable::create((int) trace.hotkeys.size());
+    for (size_t i = 0; table && i < trace.hotkeys.size(); i++) {
+        const WMITraceHotkey* entry = &trace.hotkeys[i];
+        if (entry->isPredicate) {
+            table->addPredicate(entry->notifyId, entry->mask, entry->first, entry->last, entry->actionId);
+        } else {
+            table->addExact(entry->notifyId, entry->eventData, entry->actionId);
+        }
+    }
+    return table;
+}
+
+static double percentile(const std::vector<long>& sorted, double p) {
+    size_t rank = (size_t) (p / 100 * (sorted.size() - 1) + 0.5);
+    return (double) sorted[rank];
+}
+
+static void usage() {
+    fprintf(stderr, "usage: TraceReplay [--realtime] [--repeat N] [--max-p99 NS] [--expect-matches N] trace\n");
+}
+
+int main(int argc, char* argv[]) {
+    bool realtime = false;
+    long repeat = 1;
+    long maxP99 = -1;
+    long expectMatches = -1;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-p99") == 0 && i + 1 < argc) {
+            maxP99 = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--expect-matches") == 0 && i + 1 < argc) {
+            expectMatches = atol(argv[++i]);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!path || repeat < 1) {
+        usage();
+        return 2;
+    }
+
+    WMITrace trace;
+    if (!trace.read(path)) {
+        return 2;
+    }
+    if (trace.events.empty()) {
+        fprintf(stderr, "%s: no events\n", path);
+        return 2;
+    }
+
+    ReplayDevice device(&trace);
+    WMIBlockTable table;
+    ReplayState state = {};
+    if (!table.load(&device)) {
+        fprintf(stderr, "%s: malformed _WDG\n", path);
+        return 2;
+    }
+    if (!(state.hotkeys = compileHotkeys(trace)) || !subscribe(&table, trace, &state)) {
+        HotkeyTable::free(const_cast<HotkeyTable*>(state.hotkeys));
+        table.unload();
+        return 2;
+    }
+
+    size_t eventCount = trace.events.size();
+    std::vector<long> latencies(eventCount * repeat);
+    long lateMax = 0;
+    auto start = Clock::now();
+    for (long round = 0; round < repeat; round++) {
+        auto roundStart = Clock::now();
+        for (size_t i = 0; i < eventCount; i++) {
+            if (realtime) {
+                auto scheduled = roundStart + std::chrono::nanoseconds(trace.events[i].offset);
+                std::this_thread::sleep_until(scheduled);
+                lateMax = std::max<long>(lateMax, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - scheduled).count());
+            }
+            device.current = i;
+            auto before = Clock::now();
+            table.dispatchNotify(&device, trace.events[i].notifyId);
+            latencies[round * eventCount + i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - before).count();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    double p99 = percentile(latencies, 99);
+    printf("trace      %s, platform %s, %zu events x %ld\n", path,
+           trace.header.platform[0] ? trace.header.platform : "unknown", eventCount, repeat);
+    printf("replay     %s, %.3f s, %.0f events/s\n", realtime ? "realtime" : "max speed", elapsed, latencies.size() / elapsed);
+    printf("latency ns p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %ld\n", percentile(latencies, 50),
+           percentile(latencies, 90), p99, percentile(latencies, 99.9), latencies.back());
+    if (realtime) {
+        printf("late by    at most %ld ns\n", lateMax);
+    }
+    printf("matched    %ld events\n", state.matches);
+    for (int i = 0; i < 256; i++) {
+        if (state.actions[i]) {
+            printf("  action 0x%02X  %ld\n", i, state.actions[i]);
+        }
+    }
+
+    HotkeyTable::free(const_cast<HotkeyTable*>(state.hotkeys));
+    table.unload();
+
+    int status = 0;
+    if (maxP99 >= 0 && p99 > maxP99) {
+        fprintf(stderr, "p99 latency %.0f ns is above %ld ns\n", p99, maxP99);
+        status = 1;
+    }
+    if (expectMatches >= 0 && state.matches != expectMatches) {
+        fprintf(stderr, "%ld events matched, expected %ld\n", state.matches, expectMatches);
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include <string.h>
+#include "WMITrace.hpp"
+
+bool WMITrace::read(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+        memcmp(header.magic, WMI_TRACE_MAGIC, 4) == 0 && header.version == WMI_TRACE_VERSION;
+    if (ok) {
+        header.platform[sizeof(header.platform) - 1] = '\0';
+        blockTable.resize(header.blockTableLength);
+        hotkeys.resize(header.hotkeyCount);
+        ok = fread(blockTable.data(), 1, blockTable.size(), file) == blockTable.size() &&
+            fread(hotkeys.data(), sizeof(WMITraceHotkey), hotkeys.size(), file) == hotkeys.size();
+    }
+
+    events.reserve(ok ? header.eventCount : 0);
+    payloadOffsets.reserve(ok ? header.eventCount : 0);
+    for (uint32_t i = 0; ok && i < header.eventCount; i++) {
+        WMITraceEvent event;
+        ok = fread(&event, sizeof(event), 1, file) == 1;
+        if (ok) {
+            payloadOffsets.push_back((uint32_t) payloads.size());
+            payloads.resize(payloads.size() + event.payloadLength);
+            ok = fread(payloads.data() + payloadOffsets.back(), 1, event.payloadLength, file) == event.payloadLength;
+            events.push_back(event);
+        }
+    }
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "%s: not a WMI trace or truncated\n", path);
+    }
+    return ok;
+}
+
+bool WMITraceWriter::open(const char* path, const char* platform, const void* blockTable, uint32_t blockTableLength,
+                          const WMITraceHotkey* hotkeys, uint32_t hotkeyCount) {
+    if (!(file = fopen(path, "wb"))) {
+        return false;
+    }
+
+    WMITraceHeader header = {};
+    memcpy(header.magic, WMI_TRACE_MAGIC, 4);
+    header.version = WMI_TRACE_VERSION;
+    header.blockTableLength = blockTableLength;
+    header.hotkeyCount = hotkeyCount;
+    if (platform) {
+        strncpy(header.platform, platform, sizeof(header.platform) - 1);
+    }
+    eventCount = 0;
+    return fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(blockTable, 1, blockTableLength, file) == blockTableLength &&
+        fwrite(hotkeys, sizeof(WMITraceHotkey), hotkeyCount, file) == hotkeyCount;
+}
+
+bool WMITraceWriter::add(uint64_t offset, uint8_t notifyId, uint8_t payloadType, const void* payload, uint16_t payloadLength) {
+    WMITraceEvent event = {offset, notifyId, payloadType, payloadLength};
+    if (!file || fwrite(&event, sizeof(event), 1, file) != 1 || fwrite(payload, 1, payloadLength, file) != payloadLength) {
+        return false;
+    }
+    eventCount++;
+    return true;
+}
+
+bool WMITraceWriter::close() {
+    if (!file) {
+        return false;
+    }
+    bool ok = fseek(file, offsetof(WMITraceHeader, eventCount), SEEK_SET) == 0 &&
+        fwrite(&eventCount, sizeof(eventCount), 1, file) == 1 && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+}
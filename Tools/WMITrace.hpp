@@ -0,0 +1,86 @@
+#ifndef WMITrace_hpp
+#define WMITrace_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/*
+ * A recorded WMI session, enough to replay it off the machine: the raw
+ * _WDG, the hotkey scheme that was active, then every notification with
+ * its _WED result. The file is
+ *
+ *     WMITraceHeader
+ *     blockTableLength bytes of _WDG
+ *     hotkeyCount WMITraceHotkey
+ *     eventCount WMITraceEvent, each followed by payloadLength bytes
+ *
+ * all little endian. Payloads are the WMICaptureRecord ones, so longer
+ * _WED results are cut to WMI_CAPTURE_PAYLOAD_SIZE.
+ */
+
+#define WMI_TRACE_MAGIC "WMIT"
+#define WMI_TRACE_VERSION 1
+
+struct WMITraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t blockTableLength;
+    uint32_t hotkeyCount;
+    uint32_t eventCount;        /* written when the recording is closed */
+    uint32_t reserved;
+    char platform[32];          /* PlatformName of the hotkey driver, NUL terminated */
+};
+
+/* A WMIEvents entry, exact unless isPredicate */
+struct WMITraceHotkey {
+    char guid[40];              /* string form, NUL terminated */
+    uint32_t eventData;
+    uint32_t mask;
+    uint32_t first;
+    uint32_t last;
+    uint8_t notifyId;
+    uint8_t actionId;
+    uint8_t isPredicate;
+    uint8_t reserved;
+};
+
+struct WMITraceEvent {
+    uint64_t offset;            /* ns since the first notification */
+    uint8_t notifyId;
+    uint8_t payloadType;        /* WMICapturePayloadType */
+    uint16_t payloadLength;
+};
+
+/* A trace read back, payloads are packed into one buffer */
+struct WMITrace {
+    WMITraceHeader header;
+    std::vector<uint8_t> blockTable;
+    std::vector<WMITraceHotkey> hotkeys;
+    std::vector<WMITraceEvent> events;
+    std::vector<uint32_t> payloadOffsets;
+    std::vector<uint8_t> payloads;
+
+    const uint8_t* getPayload(size_t event) const { return payloads.data() + payloadOffsets[event]; }
+
+    /* false with a message on stderr if the file is unreadable or malformed */
+    bool read(const char* path);
+};
+
+class WMITraceWriter {
+    FILE* file = nullptr;
+    uint32_t eventCount = 0;
+
+ public:
+    ~WMITraceWriter() { close(); }
+
+    bool open(const char* path, const char* platform, const void* blockTable, uint32_t blockTableLength,
+              const WMITraceHotkey* hotkeys, uint32_t hotkeyCount);
+    bool add(uint64_t offset, uint8_t notifyId, uint8_t payloadType, const void* payload, uint16_t payloadLength);
+    /* Fill in the event count, false if anything failed to be written */
+    bool close();
+
+    uint32_t getEventCount() const { return eventCount; }
+};
+
+#endif /* WMITrace_hpp */
@@ -0,0 +1,68 @@
+#ifndef ControllerInterface_h
+#define ControllerInterface_h
+
+#include <stdint.h>
+
+/* Selectors of VoodooWMIControllerUserClient */
+enum WMIControllerSelector {
+    kWMIControllerSelectorResetStatistics,
+    kWMIControllerSelectorSetCaptureMode,   /* scalar input: 1 to capture events, 0 to stop, root only */
+    kWMIControllerSelectorInjectEvent,      /* structure input: WMICaptureRecord, root only */
+};
+
+/* Memory types of VoodooWMIControllerUserClient::clientMemoryForType */
+enum WMIControllerMemoryType {
+    kWMIControllerMemoryCapture,            /* read-only WMICaptureRing, root only */
+};
+
+#define WMI_CAPTURE_VERSION 1
+#define WMI_CAPTURE_RECORDS 1024            /* must be a power of two */
+#define WMI_CAPTURE_PAYLOAD_SIZE 44
+#define WMI_CAPTURE_NO_BLOCK 0xffff
+
+/* How the _WED result was stored in WMICaptureRecord::payload */
+enum WMICapturePayloadType {
+    kWMICapturePayloadNone,                 /* _WED failed */
+    kWMICapturePayloadInteger,              /* little endian uint64_t */
+    kWMICapturePayloadBuffer,
+    kWMICapturePayloadString,               /* without the terminator */
+    kWMICapturePayloadOther,                /* a package, its first integer element as uint64_t or 0 */
+};
+
+/*
+ * A notification as captured, also the input for replaying one. Only
+ * notifyId, payloadType, payloadLength and payload are used on replay,
+ * and a payload longer than WMI_CAPTURE_PAYLOAD_SIZE is replayed truncated.
+ */
+struct WMICaptureRecord {
+    uint64_t timestamp;         /* mach absolute time of the notification */
+    uint32_t sequence;          /* position in the stream plus one, 0 while being written */
+    uint16_t blockIndex;        /* _WDG index, WMI_CAPTURE_NO_BLOCK if the notify ID is unknown */
+    uint8_t notifyId;
+    uint8_t payloadType;
+    uint32_t payloadLength;     /* full length, at most WMI_CAPTURE_PAYLOAD_SIZE bytes are kept */
+    uint8_t payload[WMI_CAPTURE_PAYLOAD_SIZE];
+};
+
+/*
+ * The kernel overwrites the oldest record when the ring is full and never
+ * waits for readers. A reader keeps its own position: it loads head, and
+ * for every position below it copies records[position % recordCount] and
+ * accepts the copy only if sequence read before and after copying equals
+ * position + 1. Otherwise the record was overwritten meanwhile, as are
+ * all records once head - position exceeds recordCount.
+ */
+struct WMICaptureHeader {
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t recordCount;
+    uint32_t head;              /* records written so far */
+    uint64_t reserved[6];
+};
+
+struct WMICaptureRing {
+    struct WMICaptureHeader header;
+    struct WMICaptureRecord records[WMI_CAPTURE_RECORDS];
+};
+
+#endif /* ControllerInterface_h */
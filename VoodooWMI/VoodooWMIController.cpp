@@ -2,33 +2,148 @@
 
 #define DEBUG_LOG(args...) do { if (this->debug) IOLog(args); } while (0)
 
+/* Forward a call for a GUID this device doesn't have to the controller owning it */
+#define ROUTE_TO_GUID_OWNER(guid, call) do { \
+    if (VoodooWMIController* owner = beginRoutedCall(guid)) { \
+        IOReturn routed = owner->call; \
+        owner->endRoutedCall(); \
+        return routed; \
+    } \
+    return kIOReturnNotFound; \
+} while (0)
+
 typedef IOService super;
 OSDefineMetaClassAndStructors(VoodooWMIController, IOService)
+OSDefineMetaClassAndStructors(VoodooWMIControllerUserClient, IOUserClient)
+
+/*
+ * Copy the bytes of an evaluation result into a caller provided buffer
+ */
+static IOReturn wmi_copy_result(OSObject* result, void* output, UInt32* outputLength) {
+    const void* bytes = nullptr;
+    UInt32 length = 0;
+    UInt64 value;
+
+    if (OSData* data = OSDynamicCast(OSData, result)) {
+        bytes = data->getBytesNoCopy();
+        length = data->getLength();
+    } else if (OSNumber* number = OSDynamicCast(OSNumber, result)) {
+        value = number->unsigned64BitValue();
+        bytes = &value;
+        length = number->numberOfBytes();
+    } else if (OSString* string = OSDynamicCast(OSString, result)) {
+        bytes = string->getCStringNoCopy();
+        length = string->getLength() + 1;
+    } else if (result) {
+        return kIOReturnUnsupported;
+    }
+
+    if (length > *outputLength) {
+        *outputLength = length;
+        return kIOReturnOverrun;
+    }
+    if (length) {
+        memcpy(output, bytes, length);
+    }
+    *outputLength = length;
+    return kIOReturnSuccess;
+}
+
+/* FNV-1a over the raw GUID */
+static UInt32 wmi_guid_hash(const WMIGuid& guid) {
+    UInt32 hash = 2166136261u;
+    for (int i = 0; i < 16; i++) {
+        hash = (hash ^ guid.bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char* wmi_stat_names[kWMIStatCount] = {
+    "Notify", "_WED", "Handler", "WQ", "WS", "WM", "WE", "WC"
+};
 
 /*
- * Convert a raw GUID to the ACII string representation
+ * Decode a _WED result, the object is referenced and not retained
  */
-static int wmi_gtoa(const char* in, char* out) {
-    int i;
+static void wmi_decode_event_data(OSObject* object, WMIEventData* data) {
+    data->length = 0;
+    data->integer = 0;
+    data->object = object;
+    if (!object) {
+        data->type = kWMIEventDataNone;
+    } else if (OSNumber* number = OSDynamicCast(OSNumber, object)) {
+        data->type = kWMIEventDataInteger;
+        data->integer = number->unsigned64BitValue();
+    } else if (OSData* buffer = OSDynamicCast(OSData, object)) {
+        data->type = kWMIEventDataBuffer;
+        data->length = buffer->getLength();
+        if (data->length <= WMI_EVENT_INLINE_SIZE) {
+            memcpy(data->inlineBytes, buffer->getBytesNoCopy(), data->length);
+        } else {
+            data->externalBytes = buffer->getBytesNoCopy();
+        }
+    } else if (OSString* string = OSDynamicCast(OSString, object)) {
+        data->type = kWMIEventDataString;
+        data->length = string->getLength();
+        if (data->length <= WMI_EVENT_INLINE_SIZE) {
+            memcpy(data->inlineBytes, string->getCStringNoCopy(), data->length);
+        } else {
+            data->externalBytes = string->getCStringNoCopy();
+        }
+    } else if (OSArray* package = OSDynamicCast(OSArray, object)) {
+        data->type = kWMIEventDataPackage;
+        data->length = package->getCount();
+        if (OSNumber* first = OSDynamicCast(OSNumber, package->getObject(0))) {
+            data->integer = first->unsigned64BitValue();
+        }
+    } else {
+        data->type = kWMIEventDataNone;
+    }
+}
 
-    for (i = 3; i >= 0; i--)
-        out += snprintf(out, 3, "%02X", in[i] & 0xFF);
+/*
+ * _WED goes through the shared notify ID arguments, anything else has its
+ * arguments boxed for the call.
+ */
+IOReturn WMIACPIDevice::evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) {
+    OSObject* object = nullptr;
+    IOReturn ret;
+    if (argumentCount == 1 && strcmp(name, "_WED") == 0) {
+        ret = controller->getEventData((UInt8) arguments[0], &object);
+    } else if (argumentCount == 0) {
+        ret = controller->device->evaluateObject(name, &object);
+    } else {
+        OSObject* argumentList[4] = {};
+        ret = argumentCount <= 4 ? kIOReturnSuccess : kIOReturnBadArgument;
+        for (int i = 0; i < argumentCount && ret == kIOReturnSuccess; i++) {
+            if (!(argumentList[i] = OSNumber::withNumber(arguments[i], 32))) {
+                ret = kIOReturnNoMemory;
+            }
+        }
+        if (ret == kIOReturnSuccess) {
+            ret = controller->device->evaluateObject(name, &object, argumentList, argumentCount);
+        }
+        for (int i = 0; i < 4; i++) {
+            OSSafeReleaseNULL(argumentList[i]);
+        }
+    }
+    if (ret != kIOReturnSuccess) {
+        OSSafeReleaseNULL(object);
+    }
+    wmi_decode_event_data(object, result);
+    return ret;
+}
 
-    out += snprintf(out, 2, "-");
-    out += snprintf(out, 3, "%02X", in[5] & 0xFF);
-    out += snprintf(out, 3, "%02X", in[4] & 0xFF);
-    out += snprintf(out, 2, "-");
-    out += snprintf(out, 3, "%02X", in[7] & 0xFF);
-    out += snprintf(out, 3, "%02X", in[6] & 0xFF);
-    out += snprintf(out, 2, "-");
-    out += snprintf(out, 3, "%02X", in[8] & 0xFF);
-    out += snprintf(out, 3, "%02X", in[9] & 0xFF);
-    out += snprintf(out, 2, "-");
+void WMIACPIDevice::release(WMIEventData* result) {
+    OSSafeReleaseNULL(result->object);
+}
 
-    for (i = 10; i <= 15; i++)
-        out += snprintf(out, 3, "%02X", in[i] & 0xFF);
+void* wmi_alloc(size_t size) {
+    return IOMallocZero(size);
+}
 
-    return 0;
+void wmi_free(void* memory, size_t size) {
+    IOFree(memory, size);
 }
 
 IOService* VoodooWMIController::probe(IOService* provider, SInt32* score) {
@@ -46,287 +161,1788 @@ bool VoodooWMIController::start(IOService* provider) {
     if (!super::start(provider)) {
         return false;
     }
-
-    debug = OSDynamicCast(OSBoolean, getProperty("DebugMode"))->getValue();
-
-    if (!loadBlocks()) {
+    if (!startController()) {
+        stopController();
+        super::stop(provider);
         return false;
     }
 
+    registerGuidRoutes();
     registerService();
 
     return true;
 }
 
 void VoodooWMIController::stop(IOService* provider) {
-    IOFree(blockList, blockCount * sizeof(WMIBlock));
-    IOFree(handlerList, blockCount * sizeof(WMIEventHandler));
-
+    stopController();
     super::stop(provider);
 }
 
-IOReturn VoodooWMIController::message(UInt32 type, IOService* provider, void* argument) {
-    if (type != kIOACPIMessageDeviceNotification || !argument) {
-        return kIOReturnSuccess;
+bool VoodooWMIController::startController() {
+    debug = OSDynamicCast(OSBoolean, getProperty("DebugMode"))->getValue();
+    deferredDelivery = getProperty("DeferredEventDelivery") == kOSBooleanTrue;
+    bool capture = getProperty("CaptureMode") == kOSBooleanTrue;
+    if (OSNumber* timeout = OSDynamicCast(OSNumber, getProperty("CollectionIdleTimeout"))) {
+        collectIdleTimeout = timeout->unsigned32BitValue();
+        nanoseconds_to_absolutetime((UInt64) collectIdleTimeout * kMillisecondScale, &collectIdleInterval);
     }
-    DEBUG_LOG("%s::message(%s, 0x%x)\n", getName(), provider->getName(), *reinterpret_cast<unsigned*>(argument));
 
-    UInt8 notifyId = *reinterpret_cast<unsigned*>(argument);
-    OSObject* eventData = nullptr;
-    int eventDataNum = 0;
-    if (getEventData(notifyId, &eventData) != kIOReturnSuccess) {
-        DEBUG_LOG("%s failed to get event data", getName());
-    } else if (OSNumber* eventID = OSDynamicCast(OSNumber, eventData)) {
-        eventDataNum = eventID->unsigned32BitValue();
+    if (!loadBlocks() || !loadQueryCache()) {
+        return false;
+    }
+    if (getProperty("DebugEnableAllEvents") == kOSBooleanTrue) {
+        setAllEventsEnabled(true);
+    }
+    if (capture) {
+        setCaptureEnabled(true);
     }
 
-    WMIBlock* targetBlock = nullptr;
-    for (int i = 0; i < blockCount; i++) {
-        WMIBlock* block = &blockList[i];
-        if (block->notifyId == notifyId) {
-            targetBlock = block;
+    if (!(workLoop = IOWorkLoop::workLoop())) {
+        return false;
+    }
+    commandGate = IOCommandGate::commandGate(this);
+    if (!commandGate || workLoop->addEventSource(commandGate) != kIOReturnSuccess) {
+        return false;
+    }
+    requestSource = IOInterruptEventSource::interruptEventSource(this, requestQueueAction);
+    if (!requestSource || !initRequestQueues() || workLoop->addEventSource(requestSource) != kIOReturnSuccess) {
+        return false;
+    }
+    requestSource->enable();
+    collectTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &VoodooWMIController::collectTimerFired));
+    if (!collectTimer || workLoop->addEventSource(collectTimer) != kIOReturnSuccess) {
+        return false;
+    }
+    if (deferredDelivery) {
+        eventSource = IOInterruptEventSource::interruptEventSource(this, eventQueueAction);
+        if (!eventSource || workLoop->addEventSource(eventSource) != kIOReturnSuccess) {
+            return false;
         }
+        eventSource->enable();
     }
-    if (targetBlock == nullptr) {
-        DEBUG_LOG("%s::unknown event, no matched block found (NotifyID: 0x%02x, EventData: 0x%x)", getName(), notifyId, eventDataNum);
-        return kIOReturnSuccess;
+
+    return true;
+}
+
+/*
+ * Undo startController(), also when it failed halfway. Routed calls and
+ * notifications are shut out first, so nothing reaches what is freed below.
+ */
+void VoodooWMIController::stopController() {
+    unregisterGuidRoutes();
+    while (__atomic_load_n(&routedCalls, __ATOMIC_SEQ_CST) != 0) {
+        IOSleep(1);
+    }
+    __atomic_store_n(&notifyClosed, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&notifyCalls, __ATOMIC_SEQ_CST) != 0) {
+        IOSleep(1);
+    }
+
+    if (eventSource) {
+        eventSource->disable();
+        workLoop->removeEventSource(eventSource);
+        OSSafeReleaseNULL(eventSource);
+        while (eventQueueTail != eventQueueHead) {
+            OSSafeReleaseNULL(eventQueue[eventQueueTail++ % WMI_EVENT_QUEUE_SIZE].eventData.object);
+        }
+    }
+    if (collectTimer) {
+        collectTimer->cancelTimeout();
+        workLoop->removeEventSource(collectTimer);
+        OSSafeReleaseNULL(collectTimer);
+    }
+    if (requestSource) {
+        requestSource->disable();
+        workLoop->removeEventSource(requestSource);
+        OSSafeReleaseNULL(requestSource);
+    }
+    freeRequestQueues();
+    if (commandGate) {
+        workLoop->removeEventSource(commandGate);
+        OSSafeReleaseNULL(commandGate);
+    }
+    OSSafeReleaseNULL(workLoop);
+
+    if (collectList) {
+        // leave no expensive collection running behind us
+        for (int i = 0; i < table.getCount(); i++) {
+            if (collectList[i].enabled) {
+                setBlockEnable(table.getBlock(i), false);
+            }
+        }
+        IOFree(collectList, table.getCount() * sizeof(WMICollectState));
+        collectList = nullptr;
     }
+    while (WMICollectHold* hold = collectHolds) {
+        collectHolds = hold->next;
+        IOFree(hold, sizeof(WMICollectHold));
+    }
+    freeQueryCache();
+
+    if (subscriberLock) {
+        IOLockFree(subscriberLock);
+        subscriberLock = nullptr;
+    }
+    if (WMIBlockStats* stats = __atomic_exchange_n(&statList, (WMIBlockStats*) nullptr, __ATOMIC_SEQ_CST)) {
+        IOFree(stats, table.getCount() * sizeof(WMIBlockStats));
+    }
+    captureEnabled = false;
+    captureRing = nullptr;
+    OSSafeReleaseNULL(captureMemory);
+    freeMethodList();
+    argumentCache.free();
+    table.unload();
+}
 
-    char guid[37];
-    wmi_gtoa(targetBlock->guid, guid);
-    DEBUG_LOG("%s event: GUID: %s, NotifyID: 0x%02x, EventData: 0x%x", getName(), guid, notifyId, eventDataNum);
+IOWorkLoop* VoodooWMIController::getWorkLoop() const {
+    return workLoop;
+}
 
-    WMIEventHandler* handler = &handlerList[targetBlock - blockList];
-    if (handler->action == nullptr) {
-        DEBUG_LOG("%s::unknown event, not registered", getName());
+IOReturn VoodooWMIController::message(UInt32 type, IOService* provider, void* argument) {
+    if (type != kIOACPIMessageDeviceNotification || !argument) {
         return kIOReturnSuccess;
     }
-    handler->action(handler->target, targetBlock, eventData);
+    DEBUG_LOG("%s::message(%s, 0x%x)\n", getName(), provider->getName(), *reinterpret_cast<unsigned*>(argument));
+
+    // stopController() closes notifications and waits for us before freeing the table
+    __atomic_add_fetch(&notifyCalls, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&notifyClosed, __ATOMIC_SEQ_CST)) {
+        UInt64 startTime;
+        clock_get_uptime(&startTime);
+        int index = table.dispatchNotify(&acpiDevice, *reinterpret_cast<unsigned*>(argument), &dispatchHooks);
+        recordStat(index, kWMIStatNotify, startTime);
+    }
+    __atomic_sub_fetch(&notifyCalls, 1, __ATOMIC_SEQ_CST);
 
     return kIOReturnSuccess;
 }
 
-bool VoodooWMIController::loadBlocks() {
-    OSObject* result = nullptr;
-    if (device->evaluateObject("_WDG", &result) != kIOReturnSuccess) {
-        return false;
+/* Nobody listens and nothing is logged, don't pay for evaluating _WED */
+bool WMIControllerHooks::wantsEventData(UInt8 notifyId, int index) {
+    return controller->debug || __atomic_load_n(&controller->captureEnabled, __ATOMIC_RELAXED);
+}
+
+void WMIControllerHooks::onEventData(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status) {
+    if (__atomic_load_n(&controller->captureEnabled, __ATOMIC_RELAXED)) {
+        controller->captureEvent(notifyId, index, eventData);
     }
+    controller->logEvent(notifyId, index, eventData, status);
+}
 
-    OSData* blocksData = OSDynamicCast(OSData, result);
-    if (blocksData == nullptr) {
-        return false;
+bool WMIControllerHooks::deferEvent(UInt8 notifyId, int index, const WMIEventData* eventData) {
+    return controller->deferredDelivery && controller->deferEvent(notifyId, eventData);
+}
+
+void WMIControllerHooks::callHandler(int index, const WMIEventHandler* handler, WMIBlock* block, const WMIEventData* eventData) {
+    UInt64 startTime;
+    clock_get_uptime(&startTime);
+    handler->action(handler->target, block, eventData);
+    controller->recordStat(index, kWMIStatHandler, startTime);
+}
+
+void VoodooWMIController::logEvent(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status) {
+    if (!debug) {
+        return;
     }
-    int dataLength = blocksData->getLength();
-    DEBUG_LOG("%s::block size %d", getName(), dataLength);
-    if (dataLength % sizeof(WMIBlock) != 0) {
-        return false;
+    if (status != kIOReturnSuccess) {
+        DEBUG_LOG("%s failed to get event data", getName());
     }
-    blockCount = dataLength / sizeof(WMIBlock);
-    if (!blockCount) {
-        return false;
+    UInt32 eventDataNum = (UInt32) eventData->toInteger();
+
+    if (index < 0) {
+        DEBUG_LOG("%s::unknown event, no matched block found (NotifyID: 0x%02x, EventData: 0x%x)", getName(), notifyId, eventDataNum);
+    } else {
+        char guid[37];
+        wmi_gtoa(table.getBlock(index)->guid, guid);
+        DEBUG_LOG("%s event: GUID: %s, NotifyID: 0x%02x, EventData: 0x%x", getName(), guid, notifyId, eventDataNum);
+        if (!table.hasSubscribers(index)) {
+            DEBUG_LOG("%s::unknown event, not registered", getName());
+        }
     }
+}
+
+/* Queue the event for the work loop, it counts as delivered even if dropped */
+bool VoodooWMIController::deferEvent(UInt8 notifyId, const WMIEventData* eventData) {
+    if (!enqueueEvent(notifyId, eventData)) {
+        DEBUG_LOG("%s::event queue overflow, event dropped", getName());
+    }
+    return true;
+}
 
-    if (!(blockList = (WMIBlock*) IOMalloc(blockCount * sizeof(WMIBlock))) ||
-        !(handlerList = (WMIEventHandler*) IOMallocZero(blockCount * sizeof(WMIEventHandler)))) {
+/*
+ * Called from message() only, which the ACPI notification thread serializes,
+ * so this is the single producer of the event queue.
+ */
+bool VoodooWMIController::enqueueEvent(UInt8 notifyId, const WMIEventData* eventData) {
+    UInt32 head = eventQueueHead;
+    if (head - __atomic_load_n(&eventQueueTail, __ATOMIC_ACQUIRE) >= WMI_EVENT_QUEUE_SIZE) {
+        __atomic_add_fetch(&eventQueueOverflow, 1, __ATOMIC_RELAXED);
+        eventSource->interruptOccurred(nullptr, this, 0);
         return false;
     }
-    memcpy(blockList, blocksData->getBytesNoCopy(), dataLength);
 
-    if (debug) {
-        // log blocks in property
-        setProperty("Raw WDG", result);
-        OSArray* array = OSArray::withCapacity(blockCount);
-        for (int i = 0; i < blockCount; i++) {
-            WMIBlock* block = &blockList[i];
-            OSDictionary* dict = OSDictionary::withCapacity(6);
-
-            char guid[37];
-            wmi_gtoa(block->guid, guid);
-            dict->setObject("GUID", OSString::withCString(guid));
-
-            char objID[3] = {0};
-            memcpy(objID, block->objectId, 2);
-            dict->setObject("ObjectID", OSString::withCString(objID));
-
-            dict->setObject("NotifyID", OSNumber::withNumber(block->notifyId, 8));
-            dict->setObject("Reserved", OSNumber::withNumber(block->reserved, 8));
-            dict->setObject("Instance", OSNumber::withNumber(block->instanceCount, 8));
-            dict->setObject("Flags", OSNumber::withNumber(block->flags, 8));
-
-            array->setObject(dict);
-            dict->release();
-        }
-        setProperty("WMI-Blocks", array);
-        array->release();
-
-        // enable all WMI events for debugging
-        for (int i = 0; i < blockCount; i++) {
-            WMIBlock* block = &blockList[i];
-            if (block->flags & ACPI_WMI_EVENT) {
-                char guid[37];
-                wmi_gtoa(block->guid, guid);
-                setEventEnable(guid, true);
-                DEBUG_LOG("%s::debug: enable event %s", getName(), guid);
-            }
-        }
+    WMIEventRecord* record = &eventQueue[head % WMI_EVENT_QUEUE_SIZE];
+    clock_get_uptime(&record->timestamp);
+    record->notifyId = notifyId;
+    record->eventData = *eventData;
+    if (eventData->object) {
+        eventData->object->retain();
     }
+    __atomic_store_n(&eventQueueHead, head + 1, __ATOMIC_RELEASE);
 
+    eventSource->interruptOccurred(nullptr, this, 0);
     return true;
 }
 
-WMIBlock* VoodooWMIController::findBlock(const char* guid) {
-    for (int i = 0; i < blockCount; i++) {
-        WMIBlock* block = &blockList[i];
-        char matchingGuid[37];
-        wmi_gtoa(block->guid, matchingGuid);
-        if (strcmp(guid, matchingGuid) == 0) {
-            return block;
+/*
+ * Runs on the work loop, the single consumer of the event queue.
+ */
+void VoodooWMIController::drainEventQueue() {
+    UInt32 tail = eventQueueTail;
+    while (tail != __atomic_load_n(&eventQueueHead, __ATOMIC_ACQUIRE)) {
+        WMIEventRecord record = eventQueue[tail % WMI_EVENT_QUEUE_SIZE];
+        __atomic_store_n(&eventQueueTail, ++tail, __ATOMIC_RELEASE);
+
+        if (debug) {
+            UInt64 now, delay;
+            clock_get_uptime(&now);
+            absolutetime_to_nanoseconds(now - record.timestamp, &delay);
+            DEBUG_LOG("%s::deliver event 0x%02x, queued for %llu us", getName(), record.notifyId, delay / 1000);
+        }
+
+        int index = table.findNotify(record.notifyId);
+        if (index >= 0) {
+            table.deliverEvent(index, &record.eventData, &dispatchHooks);
         }
+        OSSafeReleaseNULL(record.eventData.object);
+    }
+
+    UInt32 overflow = __atomic_load_n(&eventQueueOverflow, __ATOMIC_RELAXED);
+    if (overflow != publishedOverflow) {
+        publishedOverflow = overflow;
+        setProperty("EventQueueOverflow", overflow, 32);
     }
-    DEBUG_LOG("%s::block not found %s", getName(), guid);
-    return nullptr;
 }
 
-IOReturn VoodooWMIController::setEventEnable(const char* guid, bool enabled) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+bool VoodooWMIController::allocateCaptureRing() {
+    if (__atomic_load_n(&captureRing, __ATOMIC_ACQUIRE)) {
+        return true;
     }
-    if (!(block->flags & ACPI_WMI_EVENT)) {
-        return kIOReturnInvalid;
+
+    IOBufferMemoryDescriptor* memory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                                             sizeof(WMICaptureRing), PAGE_SIZE);
+    if (!memory) {
+        return false;
     }
+    WMICaptureRing* ring = static_cast<WMICaptureRing*>(memory->getBytesNoCopy());
+    bzero(ring, sizeof(WMICaptureRing));
+    ring->header.version = WMI_CAPTURE_VERSION;
+    ring->header.recordSize = sizeof(WMICaptureRecord);
+    ring->header.recordCount = WMI_CAPTURE_RECORDS;
 
-    char methodName[5] = {0};
-    snprintf(methodName, 5, "WE%02X", block->notifyId);
+    if (!OSCompareAndSwapPtr(nullptr, memory, reinterpret_cast<void* volatile*>(&captureMemory))) {
+        memory->release();
+        return __atomic_load_n(&captureRing, __ATOMIC_ACQUIRE) != nullptr;
+    }
+    __atomic_store_n(&captureRing, ring, __ATOMIC_RELEASE);
+    return true;
+}
 
-    OSNumber* argument = OSNumber::withNumber(enabled ? 1 : 0, 8);
-    OSObject* argumentList[] = { argument };
-    return device->evaluateObject(methodName, nullptr, argumentList, 1);
+IOReturn VoodooWMIController::setCaptureEnabled(bool enabled) {
+    if (enabled && !allocateCaptureRing()) {
+        return kIOReturnNoMemory;
+    }
+    __atomic_store_n(&captureEnabled, enabled, __ATOMIC_RELEASE);
+    DEBUG_LOG("%s::event capture %s", getName(), enabled ? "on" : "off");
+    return kIOReturnSuccess;
 }
 
-IOReturn VoodooWMIController::setBlockEnable(const char* guid, bool enabled) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+IOReturn VoodooWMIController::copyCaptureMemory(IOMemoryDescriptor** memory) {
+    if (!allocateCaptureRing()) {
+        return kIOReturnNoMemory;
     }
-    if (block->flags & (ACPI_WMI_EVENT | ACPI_WMI_METHOD)) {
-        return kIOReturnInvalid;
+    captureMemory->retain();
+    *memory = captureMemory;
+    return kIOReturnSuccess;
+}
+
+/*
+ * Called from message() only, the single writer of the capture ring.
+ * Readers are never waited for, the oldest record is overwritten.
+ */
+void VoodooWMIController::captureEvent(UInt8 notifyId, int index, const WMIEventData* eventData) {
+    WMICaptureRing* ring = __atomic_load_n(&captureRing, __ATOMIC_ACQUIRE);
+    if (!ring) {
+        return;
     }
 
-    char methodName[5] = {0};
-    strncpy(methodName, "WC", 2);
-    strncat(methodName, block->objectId, 2);
+    UInt32 head = ring->header.head;
+    WMICaptureRecord* record = &ring->records[head % WMI_CAPTURE_RECORDS];
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    OSNumber* argument = OSNumber::withNumber(enabled ? 1 : 0, 8);
-    OSObject* argumentList[] = { argument };
-    return device->evaluateObject(methodName, nullptr, argumentList, 1);
-}
+    UInt64 timestamp;
+    clock_get_uptime(&timestamp);
+    record->timestamp = timestamp;
+    record->blockIndex = index >= 0 ? (UInt16) index : WMI_CAPTURE_NO_BLOCK;
+    record->notifyId = notifyId;
+    record->payloadLength = 0;
+    switch (eventData->type) {
+        case kWMIEventDataNone:
+            record->payloadType = kWMICapturePayloadNone;
+            break;
+        case kWMIEventDataInteger:
+            record->payloadType = kWMICapturePayloadInteger;
+            record->payloadLength = sizeof(eventData->integer);
+            memcpy(record->payload, &eventData->integer, sizeof(eventData->integer));
+            break;
+        case kWMIEventDataBuffer:
+        case kWMIEventDataString:
+            record->payloadType = eventData->type == kWMIEventDataBuffer ? kWMICapturePayloadBuffer : kWMICapturePayloadString;
+            record->payloadLength = eventData->length;
+            memcpy(record->payload, eventData->getBytes(),
+                   eventData->length < WMI_CAPTURE_PAYLOAD_SIZE ? eventData->length : WMI_CAPTURE_PAYLOAD_SIZE);
+            break;
+        default:
+            record->payloadType = kWMICapturePayloadOther;
+            record->payloadLength = sizeof(eventData->integer);
+            memcpy(record->payload, &eventData->integer, sizeof(eventData->integer));
+            break;
+    }
 
-bool VoodooWMIController::hasGuid(const char* guid) {
-    return (findBlock(guid) != nullptr);
+    __atomic_store_n(&record->sequence, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header.head, head + 1, __ATOMIC_RELEASE);
 }
 
-IOReturn VoodooWMIController::getEventData(UInt8 notifyId, OSObject** result) {
-    char methodName[5] = "_WED";
+IOReturn VoodooWMIController::injectEvent(const WMICaptureRecord* record) {
+    WMIEventData eventData = {};
+    UInt32 length = record->payloadLength < WMI_CAPTURE_PAYLOAD_SIZE ? record->payloadLength : WMI_CAPTURE_PAYLOAD_SIZE;
+    switch (record->payloadType) {
+        case kWMICapturePayloadInteger:
+        case kWMICapturePayloadOther:
+            eventData.type = record->payloadType == kWMICapturePayloadInteger ? kWMIEventDataInteger : kWMIEventDataPackage;
+            memcpy(&eventData.integer, record->payload, length < sizeof(eventData.integer) ? length : sizeof(eventData.integer));
+            break;
+        case kWMICapturePayloadBuffer:
+        case kWMICapturePayloadString:
+            eventData.type = record->payloadType == kWMICapturePayloadBuffer ? kWMIEventDataBuffer : kWMIEventDataString;
+            eventData.length = length;
+            if (length <= WMI_EVENT_INLINE_SIZE) {
+                memcpy(eventData.inlineBytes, record->payload, length);
+            } else {
+                eventData.externalBytes = record->payload;
+            }
+            break;
+        default:
+            eventData.type = kWMIEventDataNone;
+            break;
+    }
 
-    OSNumber* argument = OSNumber::withNumber(notifyId, 8);
-    OSObject* argumentList[] = { argument };
-    return device->evaluateObject(methodName, result, argumentList, 1);
+    UInt8 notifyId = record->notifyId;
+    return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::injectEventGated),
+                                  &notifyId, &eventData);
 }
 
-IOReturn VoodooWMIController::registerWMIEvent(const char* guid, OSObject* target, WMIEventAction handler) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
+/*
+ * Injected events are serialized by the command gate instead of the ACPI
+ * notification thread, and never enter the capture ring or event queue.
+ */
+IOReturn VoodooWMIController::injectEventGated(UInt8* notifyId, WMIEventData* eventData) {
+    UInt64 startTime;
+    clock_get_uptime(&startTime);
+    int index = table.findNotify(*notifyId);
+    if (index < 0) {
         return kIOReturnNotFound;
     }
-    if (!(block->flags & ACPI_WMI_EVENT)) {
-        return kIOReturnInvalid;
+
+    DEBUG_LOG("%s::inject event 0x%02x", getName(), *notifyId);
+    table.deliverEvent(index, eventData, &dispatchHooks);
+    recordStat(index, kWMIStatNotify, startTime);
+    return kIOReturnSuccess;
+}
+
+void VoodooWMIController::eventQueueAction(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    if (VoodooWMIController* controller = OSDynamicCast(VoodooWMIController, owner)) {
+        controller->drainEventQueue();
+    }
+}
+
+bool VoodooWMIController::loadBlocks() {
+    if (!table.load(&acpiDevice)) {
+        return false;
     }
+    DEBUG_LOG("%s::block count %d", getName(), table.getCount());
 
-    handlerList[block - blockList].target = target;
-    handlerList[block - blockList].action = handler;
+    if (!(subscriberLock = IOLockAlloc()) ||
+        !(collectList = (WMICollectState*) IOMallocZero(table.getCount() * sizeof(WMICollectState))) ||
+        !(statList = (WMIBlockStats*) IOMallocZero(table.getCount() * sizeof(WMIBlockStats)))) {
+        return false;
+    }
 
-    return setEventEnable(guid, true);
+    return buildMethodList() && argumentCache.init(table);
 }
 
-IOReturn VoodooWMIController::unregisterWMIEvent(const char* guid) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+/*
+ * The block description is only built when somebody reads the registry
+ * entry, not on every boot.
+ */
+void VoodooWMIController::publishBlockProperties() {
+    if (!debug || !table.getCount() || !OSCompareAndSwap(0, 1, &blockPropertiesPublished)) {
+        return;
     }
-    if (!(block->flags & ACPI_WMI_EVENT)) {
-        return kIOReturnInvalid;
+
+    if (OSData* rawData = OSData::withBytes(table.getBlock(0), table.getCount() * sizeof(WMIBlock))) {
+        setProperty("Raw WDG", rawData);
+        rawData->release();
+    }
+
+    OSArray* array = OSArray::withCapacity(table.getCount());
+    if (!array) {
+        return;
     }
+    for (int i = 0; i < table.getCount(); i++) {
+        WMIBlock* block = table.getBlock(i);
+        OSDictionary* dict = OSDictionary::withCapacity(6);
+        if (!dict) {
+            break;
+        }
+
+        char guid[37];
+        wmi_gtoa(block->guid, guid);
+        char objID[3] = {0};
+        memcpy(objID, block->objectId, 2);
 
-    handlerList[block - blockList].target = nullptr;
-    handlerList[block - blockList].action = nullptr;
+        OSObject* values[] = {
+            OSString::withCString(guid),
+            OSString::withCString(objID),
+            OSNumber::withNumber(block->notifyId, 8),
+            OSNumber::withNumber(block->reserved, 8),
+            OSNumber::withNumber(block->instanceCount, 8),
+            OSNumber::withNumber(block->flags, 8),
+        };
+        static const char* keys[] = {"GUID", "ObjectID", "NotifyID", "Reserved", "Instance", "Flags"};
+        for (int j = 0; j < 6; j++) {
+            if (values[j]) {
+                dict->setObject(keys[j], values[j]);
+                values[j]->release();
+            }
+        }
 
-    return setEventEnable(guid, false);
+        array->setObject(dict);
+        dict->release();
+    }
+    setProperty("WMI-Blocks", array);
+    array->release();
 }
 
-IOReturn VoodooWMIController::setBlock(const char* guid, UInt8 instanceIndex, OSObject* inputData) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+bool VoodooWMIController::serializeProperties(OSSerialize* serialize) const {
+    const_cast<VoodooWMIController*>(this)->publishBlockProperties();
+    const_cast<VoodooWMIController*>(this)->publishStatistics();
+    return super::serializeProperties(serialize);
+}
+
+OSObject* VoodooWMIController::copyProperty(const char* aKey) const {
+    if (aKey && (strcmp(aKey, "WMI-Blocks") == 0 || strcmp(aKey, "Raw WDG") == 0)) {
+        const_cast<VoodooWMIController*>(this)->publishBlockProperties();
+    } else if (aKey && strcmp(aKey, "WMI-Statistics") == 0) {
+        const_cast<VoodooWMIController*>(this)->publishStatistics();
     }
-    if (!(block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
-        return kIOReturnInvalid;
+    return super::copyProperty(aKey);
+}
+
+/*
+ * Enable every WMI event for debugging, or give back the ones nobody subscribed to
+ */
+void VoodooWMIController::setAllEventsEnabled(bool enabled) {
+    IOLockLock(subscriberLock);
+    if (enabled != allEventsEnabled) {
+        allEventsEnabled = enabled;
+        for (int i = 0; i < table.getCount(); i++) {
+            WMIBlock* block = table.getBlock(i);
+            if ((block->flags & ACPI_WMI_EVENT) && !table.getSubscribers(i)) {
+                setEventEnable(block, enabled);
+                DEBUG_LOG("%s::debug: %s event %d", getName(), enabled ? "enable" : "disable", i);
+            }
+        }
+    }
+    IOLockUnlock(subscriberLock);
+}
+
+IOReturn VoodooWMIController::setProperties(OSObject* properties) {
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+    if (!dict) {
+        return kIOReturnBadArgument;
+    }
+    OSBoolean* enableAllEvents = OSDynamicCast(OSBoolean, dict->getObject("EnableAllEvents"));
+    OSBoolean* captureMode = OSDynamicCast(OSBoolean, dict->getObject("CaptureMode"));
+    if (!enableAllEvents && !captureMode) {
+        return kIOReturnUnsupported;
+    }
+    // Both make every notification evaluate _WED, capture also exposes the payloads
+    IOReturn ret = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (ret != kIOReturnSuccess) {
+        return ret;
+    }
+    if (enableAllEvents) {
+        setAllEventsEnabled(enableAllEvents->getValue());
     }
+    return captureMode ? setCaptureEnabled(captureMode->getValue()) : kIOReturnSuccess;
+}
 
-    char methodName[5] = {0};
-    strncpy(methodName, "WS", 2);
-    strncat(methodName, block->objectId, 2);
+/*
+ * Intern every block's ACPI method names up front, so evaluations go through
+ * the OSSymbol overload of evaluateObject instead of building and interning
+ * the name on each call.
+ */
+bool VoodooWMIController::buildMethodList() {
+    if (!(methodList = (WMIBlockMethods*) IOMallocZero(table.getCount() * sizeof(WMIBlockMethods))) ||
+        !(eventDataMethod = OSSymbol::withCString("_WED"))) {
+        return false;
+    }
 
-    OSObject* argumentList[] = {
-        OSNumber::withNumber(instanceIndex, 8),
-        inputData
-    };
-    return device->evaluateObject(methodName, nullptr, argumentList, 2);
+    for (int i = 0; i < table.getCount(); i++) {
+        WMIBlock* block = table.getBlock(i);
+        WMIBlockMethods* methods = &methodList[i];
+        const OSSymbol** symbols[] = {
+            &methods->eventEnable,
+            &methods->collectEnable,
+            &methods->query,
+            &methods->set,
+            &methods->method,
+        };
+        for (int kind = kWMIMethodEventEnable; kind <= kWMIMethod; kind++) {
+            char name[5];
+            if (WMIBlockTable::getMethodName(block, (WMIMethodKind) kind, name) &&
+                !(*symbols[kind] = OSSymbol::withCString(name))) {
+                return false;
+            }
+        }
+    }
+
+    return true;
 }
 
-IOReturn VoodooWMIController::queryBlock(const char* guid, UInt8 instanceIndex, OSObject** result) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+void VoodooWMIController::freeMethodList() {
+    if (methodList) {
+        for (int i = 0; i < table.getCount(); i++) {
+            WMIBlockMethods* methods = &methodList[i];
+            OSSafeReleaseNULL(methods->eventEnable);
+            OSSafeReleaseNULL(methods->collectEnable);
+            OSSafeReleaseNULL(methods->query);
+            OSSafeReleaseNULL(methods->set);
+            OSSafeReleaseNULL(methods->method);
+        }
+        IOFree(methodList, table.getCount() * sizeof(WMIBlockMethods));
+        methodList = nullptr;
     }
-    if (!(block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
-        return kIOReturnInvalid;
+    OSSafeReleaseNULL(eventDataMethod);
+}
+
+WMIBlock* VoodooWMIController::findBlock(const WMIGuid& guid) {
+    if (WMIBlock* block = table.find(guid)) {
+        return block;
+    }
+    if (debug) {
+        char string[37];
+        wmi_gtoa(reinterpret_cast<const char*>(guid.bytes), string);
+        DEBUG_LOG("%s::block not found %s%s", getName(), string, guid.valid ? "" : " (malformed)");
+    }
+    return nullptr;
+}
+
+/*
+ * Account the time since startTime to an operation of a block. Called on
+ * the notification, work loop and client threads alike, so every field is
+ * updated atomically instead of taking a lock on the hot path.
+ */
+void VoodooWMIController::recordStat(int index, WMIStatOp op, UInt64 startTime) {
+    if (index < 0) {
+        if (op == kWMIStatNotify) {
+            __atomic_add_fetch(&unknownNotifyCount, 1, __ATOMIC_RELAXED);
+        }
+        return;
     }
 
-    char methodName[5] = {0};
-    strncpy(methodName, "WQ", 2);
-    strncat(methodName, block->objectId, 2);
+    WMIBlockStats* blockStats = __atomic_load_n(&statList, __ATOMIC_ACQUIRE);
+    if (!blockStats) {
+        return;     // not started yet or stopped
+    }
 
-    OSObject* argumentList[] = { OSNumber::withNumber(instanceIndex, 8) };
+    UInt64 now, elapsed;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - startTime, &elapsed);
 
-    if (block->flags & ACPI_WMI_EXPENSIVE) {
-        setBlockEnable(guid, true);
+    WMIOpStats* stats = &blockStats[index].ops[op];
+    __atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->totalTime, elapsed, __ATOMIC_RELAXED);
+    UInt64 max = __atomic_load_n(&stats->maxTime, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&stats->maxTime, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
-    IOReturn ret = device->evaluateObject(methodName, result, argumentList, 1);
-    if (block->flags & ACPI_WMI_EXPENSIVE) {
-        setBlockEnable(guid, false);
+
+    UInt64 us = elapsed / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= WMI_LATENCY_BUCKETS) {
+        bucket = WMI_LATENCY_BUCKETS - 1;
     }
+    __atomic_add_fetch(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
 
+IOReturn VoodooWMIController::evaluateBlockObject(WMIBlock* block, WMIStatOp op, const OSSymbol* method,
+                                                  OSObject** result, OSObject** argumentList, UInt32 argumentCount) {
+    UInt64 startTime;
+    clock_get_uptime(&startTime);
+    IOReturn ret = device->evaluateObject(method, result, argumentList, argumentCount);
+    recordStat(table.getIndex(block), op, startTime);
     return ret;
 }
 
-IOReturn VoodooWMIController::evaluateMethod(const char* guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result) {
-    WMIBlock* block = nullptr;
-    if (!(block = findBlock(guid))) {
-        return kIOReturnNotFound;
+/*
+ * Counts taken concurrently with a reset may survive it, which is fine
+ * for statistics.
+ */
+void VoodooWMIController::resetStatistics() {
+    if (statList) {
+        bzero(statList, table.getCount() * sizeof(WMIBlockStats));
     }
-    if (!(block->flags & ACPI_WMI_METHOD)) {
-        return kIOReturnInvalid;
+    __atomic_store_n(&unknownNotifyCount, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Snapshot the counters into WMI-Statistics, one entry per block in _WDG
+ * order listing only the operations that ran. Rebuilt on every registry
+ * read, the counters themselves are never published.
+ */
+void VoodooWMIController::publishStatistics() {
+    if (!statList) {
+        return;
     }
 
-    char methodName[5] = {0};
-    strncpy(methodName, "WM", 2);
-    strncat(methodName, block->objectId, 2);
+    OSDictionary* statistics = OSDictionary::withCapacity(2);
+    OSArray* blocks = OSArray::withCapacity(table.getCount());
+    if (!statistics || !blocks) {
+        OSSafeReleaseNULL(statistics);
+        OSSafeReleaseNULL(blocks);
+        return;
+    }
+    for (int i = 0; i < table.getCount(); i++) {
+        OSDictionary* dict = OSDictionary::withCapacity(kWMIStatCount + 1);
+        if (!dict) {
+            break;
+        }
 
-    OSObject* argumentList[] = {
-        OSNumber::withNumber(instanceIndex, 8),
-        OSNumber::withNumber(methodId, 32),
-        inputData
-    };
-    return device->evaluateObject(methodName, result, argumentList, 3);
+        char guid[37];
+        wmi_gtoa(table.getBlock(i)->guid, guid);
+        if (OSString* guidString = OSString::withCString(guid)) {
+            dict->setObject("GUID", guidString);
+            guidString->release();
+        }
+
+        for (int op = 0; op < kWMIStatCount; op++) {
+            WMIOpStats* stats = &statList[i].ops[op];
+            UInt64 count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+            if (!count) {
+                continue;
+            }
+            OSDictionary* opDict = OSDictionary::withCapacity(4);
+            OSArray* histogram = OSArray::withCapacity(WMI_LATENCY_BUCKETS);
+            if (!opDict || !histogram) {
+                OSSafeReleaseNULL(opDict);
+                OSSafeReleaseNULL(histogram);
+                continue;
+            }
+            // trailing empty buckets are left out
+            int used = WMI_LATENCY_BUCKETS;
+            while (used > 0 && !__atomic_load_n(&stats->histogram[used - 1], __ATOMIC_RELAXED)) {
+                used--;
+            }
+            for (int bucket = 0; bucket < used; bucket++) {
+                if (OSNumber* number = OSNumber::withNumber(__atomic_load_n(&stats->histogram[bucket], __ATOMIC_RELAXED), 32)) {
+                    histogram->setObject(number);
+                    number->release();
+                }
+            }
+            OSObject* values[] = {
+                OSNumber::withNumber(count, 64),
+                OSNumber::withNumber(__atomic_load_n(&stats->totalTime, __ATOMIC_RELAXED) / 1000, 64),
+                OSNumber::withNumber(__atomic_load_n(&stats->maxTime, __ATOMIC_RELAXED) / 1000, 64),
+                histogram,
+            };
+            static const char* keys[] = {"Count", "TotalTime", "MaxTime", "Histogram"};
+            for (int j = 0; j < 4; j++) {
+                if (values[j]) {
+                    opDict->setObject(keys[j], values[j]);
+                    values[j]->release();
+                }
+            }
+            dict->setObject(wmi_stat_names[op], opDict);
+            opDict->release();
+        }
+
+        blocks->setObject(dict);
+        dict->release();
+    }
+    statistics->setObject("Blocks", blocks);
+    blocks->release();
+    if (OSNumber* unknown = OSNumber::withNumber(__atomic_load_n(&unknownNotifyCount, __ATOMIC_RELAXED), 64)) {
+        statistics->setObject("UnknownNotify", unknown);
+        unknown->release();
+    }
+    setProperty("WMI-Statistics", statistics);
+    statistics->release();
+}
+
+IOReturn VoodooWMIController::setEventEnable(WMIBlock* block, bool enabled) {
+    if (!(block->flags & ACPI_WMI_EVENT)) {
+        return kIOReturnInvalid;
+    }
+
+    OSNumber* argument = argumentCache.copyFlag(enabled);
+    OSObject* argumentList[] = { argument };
+    IOReturn ret = evaluateBlockObject(block, kWMIStatEventEnable, methodList[table.getIndex(block)].eventEnable, nullptr, argumentList, 1);
+    argument->release();
+    return ret;
+}
+
+IOReturn VoodooWMIController::setBlockEnable(WMIBlock* block, bool enabled) {
+    if (block->flags & (ACPI_WMI_EVENT | ACPI_WMI_METHOD)) {
+        return kIOReturnInvalid;
+    }
+
+    OSNumber* argument = argumentCache.copyFlag(enabled);
+    OSObject* argumentList[] = { argument };
+    IOReturn ret = evaluateBlockObject(block, kWMIStatCollectEnable, methodList[table.getIndex(block)].collectEnable, nullptr, argumentList, 1);
+    argument->release();
+    return ret;
+}
+
+bool VoodooWMIController::hasGuid(const WMIGuid& guid) {
+    return (findBlock(guid) != nullptr);
+}
+
+int VoodooWMIController::getBlockGuids(WMIGuid* guids, int capacity) {
+    int count = 0;
+    table.forEachGuid([&](int index) {
+        if (count < capacity) {
+            guids[count] = WMIGuid::fromRaw(table.getBlock(index)->guid);
+        }
+        count++;
+    });
+    return count;
+}
+
+/*
+ * A single open-addressed table maps every GUID of every attached WMI
+ * device to its controller. It only changes when a controller starts or
+ * stops, lookups are a hash and a short probe.
+ */
+WMIGuidRoute VoodooWMIController::guidRoutes[WMI_GUID_ROUTE_SIZE];
+IOLock* VoodooWMIController::guidRouteLock = nullptr;
+
+IOLock* VoodooWMIController::getGuidRouteLock() {
+    if (!guidRouteLock) {
+        IOLock* lock = IOLockAlloc();
+        if (lock && !OSCompareAndSwapPtr(nullptr, lock, reinterpret_cast<void* volatile*>(&guidRouteLock))) {
+            IOLockFree(lock);
+        }
+    }
+    return guidRouteLock;
+}
+
+void VoodooWMIController::registerGuidRoutes() {
+    IOLock* lock = getGuidRouteLock();
+    if (!lock) {
+        return;
+    }
+
+    IOLockLock(lock);
+    // only the first block of a duplicated GUID is reachable
+    table.forEachGuid([&](int index) {
+        WMIGuid guid = WMIGuid::fromRaw(table.getBlock(index)->guid);
+        UInt32 slot = wmi_guid_hash(guid) % WMI_GUID_ROUTE_SIZE;
+        WMIGuidRoute* freeRoute = nullptr;
+        bool known = false;
+        for (int probe = 0; probe < WMI_GUID_ROUTE_SIZE; probe++) {
+            WMIGuidRoute* route = &guidRoutes[(slot + probe) % WMI_GUID_ROUTE_SIZE];
+            if (route->owner && guid.compare(reinterpret_cast<const char*>(route->guid.bytes)) == 0) {
+                known = true;
+                break;
+            }
+            if (!route->owner && !freeRoute) {
+                freeRoute = route;
+            }
+            if (!route->owner && !route->deleted) {
+                break;
+            }
+        }
+        if (known) {
+            DEBUG_LOG("%s::GUID of block %d is served by another WMI device", getName(), index);
+        } else if (freeRoute) {
+            freeRoute->guid = guid;
+            freeRoute->owner = this;
+            freeRoute->deleted = false;
+        } else {
+            IOLog("%s::GUID route table is full\n", getName());
+        }
+    });
+    IOLockUnlock(lock);
+}
+
+void VoodooWMIController::unregisterGuidRoutes() {
+    IOLock* lock = getGuidRouteLock();
+    if (!lock) {
+        return;
+    }
+
+    IOLockLock(lock);
+    for (int i = 0; i < WMI_GUID_ROUTE_SIZE; i++) {
+        if (guidRoutes[i].owner == this) {
+            guidRoutes[i].owner = nullptr;
+            guidRoutes[i].deleted = true;
+        }
+    }
+    IOLockUnlock(lock);
+}
+
+/*
+ * Called with guidRouteLock held
+ */
+VoodooWMIController* VoodooWMIController::lookupGuidRoute(const WMIGuid& guid) {
+    UInt32 slot = wmi_guid_hash(guid) % WMI_GUID_ROUTE_SIZE;
+    for (int probe = 0; probe < WMI_GUID_ROUTE_SIZE; probe++) {
+        WMIGuidRoute* route = &guidRoutes[(slot + probe) % WMI_GUID_ROUTE_SIZE];
+        if (route->owner && guid.compare(reinterpret_cast<const char*>(route->guid.bytes)) == 0) {
+            return route->owner;
+        }
+        if (!route->owner && !route->deleted) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+VoodooWMIController* VoodooWMIController::copyControllerForGuid(const WMIGuid& guid) {
+    IOLock* lock = getGuidRouteLock();
+    if (!lock || !guid.valid) {
+        return nullptr;
+    }
+
+    IOLockLock(lock);
+    VoodooWMIController* owner = lookupGuidRoute(guid);
+    if (owner) {
+        owner->retain();
+    }
+    IOLockUnlock(lock);
+
+    return owner;
+}
+
+/*
+ * The owner of a GUID this controller lacks, retained and marked busy so
+ * it is not torn down under the call. Pair with endRoutedCall().
+ */
+VoodooWMIController* VoodooWMIController::beginRoutedCall(const WMIGuid& guid) {
+    IOLock* lock = getGuidRouteLock();
+    if (!lock || !guid.valid) {
+        return nullptr;
+    }
+
+    IOLockLock(lock);
+    VoodooWMIController* owner = lookupGuidRoute(guid);
+    if (owner == this || (owner && owner->isInactive())) {
+        owner = nullptr;
+    }
+    if (owner) {
+        owner->retain();
+        __atomic_add_fetch(&owner->routedCalls, 1, __ATOMIC_SEQ_CST);
+    }
+    IOLockUnlock(lock);
+
+    return owner;
+}
+
+void VoodooWMIController::endRoutedCall() {
+    __atomic_sub_fetch(&routedCalls, 1, __ATOMIC_SEQ_CST);
+    release();
+}
+
+IOReturn VoodooWMIController::getEventData(UInt8 notifyId, OSObject** result) {
+    OSNumber* argument = argumentCache.copyNotify(notifyId);
+    if (!argument) {
+        return kIOReturnNoMemory;
+    }
+    OSObject* argumentList[] = { argument };
+    UInt64 startTime;
+    clock_get_uptime(&startTime);
+    IOReturn ret = device->evaluateObject(eventDataMethod, result, argumentList, 1);
+    recordStat(table.findNotify(notifyId), kWMIStatEventData, startTime);
+    argument->release();
+    return ret;
+}
+
+IOReturn VoodooWMIController::registerWMIEvent(const WMIGuid& guid, OSObject* target, WMIEventAction handler) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, registerWMIEvent(guid, target, handler));
+    }
+    if (!(block->flags & ACPI_WMI_EVENT)) {
+        return kIOReturnInvalid;
+    }
+
+    int index = table.getIndex(block);
+    IOReturn ret = kIOReturnSuccess;
+    IOLockLock(subscriberLock);
+    WMISubscriberList* old = table.getSubscribers(index);
+    int count = old ? old->count : 0;
+    int position = count;
+    for (int i = 0; i < count; i++) {
+        if (old->handlers[i].target == target) {
+            position = i;
+        }
+    }
+    WMISubscriberList* list = WMIBlockTable::allocSubscribers(position < count ? count : count + 1);
+    if (!list) {
+        ret = kIOReturnNoMemory;
+    } else {
+        if (count) {
+            memcpy(list->handlers, old->handlers, count * sizeof(WMIEventHandler));
+        }
+        list->handlers[position].target = target;
+        list->handlers[position].action = handler;
+        table.publishSubscribers(index, list);
+        if (!count && !allEventsEnabled) {
+            ret = setEventEnable(block, true);
+        }
+    }
+    IOLockUnlock(subscriberLock);
+
+    return ret;
+}
+
+IOReturn VoodooWMIController::unregisterWMIEvent(const WMIGuid& guid, OSObject* target) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, unregisterWMIEvent(guid, target));
+    }
+    if (!(block->flags & ACPI_WMI_EVENT)) {
+        return kIOReturnInvalid;
+    }
+
+    int index = table.getIndex(block);
+    IOReturn ret = kIOReturnNotFound;
+    bool removed = false;
+    IOLockLock(subscriberLock);
+    WMISubscriberList* old = table.getSubscribers(index);
+    int count = old ? old->count : 0;
+    for (int i = 0; i < count; i++) {
+        if (old->handlers[i].target != target) {
+            continue;
+        }
+        if (count == 1) {
+            table.publishSubscribers(index, nullptr);
+            removed = true;
+            ret = allEventsEnabled ? kIOReturnSuccess : setEventEnable(block, false);
+        } else if (WMISubscriberList* list = WMIBlockTable::allocSubscribers(count - 1)) {
+            memcpy(list->handlers, old->handlers, i * sizeof(WMIEventHandler));
+            memcpy(&list->handlers[i], &old->handlers[i + 1], (count - i - 1) * sizeof(WMIEventHandler));
+            table.publishSubscribers(index, list);
+            removed = true;
+            ret = kIOReturnSuccess;
+        } else {
+            ret = kIOReturnNoMemory;
+        }
+        break;
+    }
+    IOLockUnlock(subscriberLock);
+
+    // A dispatcher that loaded the old snapshot may still call target, wait it out
+    if (removed) {
+        while (table.isDispatching()) {
+            IOSleep(1);
+        }
+        IOLockLock(subscriberLock);
+        table.reclaimSubscribers(false);
+        IOLockUnlock(subscriberLock);
+    }
+
+    return ret;
+}
+
+IOReturn VoodooWMIController::setBlock(const WMIGuid& guid, UInt8 instanceIndex, OSObject* inputData) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, setBlock(guid, instanceIndex, inputData));
+    }
+    if (!(block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
+        return kIOReturnInvalid;
+    }
+
+    OSNumber* instance = argumentCache.copyInstance(instanceIndex);
+    if (!instance) {
+        return kIOReturnNoMemory;
+    }
+    OSObject* argumentList[] = {
+        instance,
+        inputData
+    };
+    IOReturn ret = evaluateBlockObject(block, kWMIStatSet, methodList[table.getIndex(block)].set, nullptr, argumentList, 2);
+    instance->release();
+    invalidateCache(block);
+    return ret;
+}
+
+IOReturn VoodooWMIController::queryBlock(const WMIGuid& guid, UInt8 instanceIndex, OSObject** result) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, queryBlock(guid, instanceIndex, result));
+    }
+    if (!(block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
+        return kIOReturnInvalid;
+    }
+
+    return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::queryBlockGated),
+                                  block, &instanceIndex, result);
+}
+
+IOReturn VoodooWMIController::queryBlockGated(WMIBlock* block, UInt8* instanceIndex, OSObject** result) {
+    if (cacheLookup(block, *instanceIndex, result)) {
+        return kIOReturnSuccess;
+    }
+
+    bool collecting = (block->flags & ACPI_WMI_EXPENSIVE) && acquireCollection(block) == kIOReturnSuccess;
+    IOReturn ret = evaluateQuery(block, *instanceIndex, result);
+    if (collecting) {
+        releaseCollection(block);
+    }
+
+    return ret;
+}
+
+IOReturn VoodooWMIController::evaluateQuery(WMIBlock* block, UInt8 instanceIndex, OSObject** result) {
+    OSNumber* instance = argumentCache.copyInstance(instanceIndex);
+    if (!instance) {
+        return kIOReturnNoMemory;
+    }
+    OSObject* argumentList[] = { instance };
+    IOReturn ret = evaluateBlockObject(block, kWMIStatQuery, methodList[table.getIndex(block)].query, result, argumentList, 1);
+    instance->release();
+    if (ret == kIOReturnSuccess && result) {
+        cacheStore(block, instanceIndex, *result);
+    }
+    return ret;
+}
+
+IOReturn VoodooWMIController::queryBlocks(const WMIQueryRequest* requests, int count, OSArray** results) {
+    if (!requests || count <= 0 || !results) {
+        return kIOReturnBadArgument;
+    }
+    *results = nullptr;
+
+    int* blockIndices = (int*) IOMalloc(count * sizeof(int));
+    if (!blockIndices) {
+        return kIOReturnNoMemory;
+    }
+    bool remote = false;
+    for (int i = 0; i < count; i++) {
+        WMIBlock* block = findBlock(requests[i].guid);
+        if (block && (block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
+            blockIndices[i] = table.getIndex(block);
+        } else {
+            blockIndices[i] = block ? -1 : -2;
+            remote |= !block;
+        }
+    }
+
+    IOReturn ret = commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::queryBlocksGated),
+                                          const_cast<WMIQueryRequest*>(requests), blockIndices, &count, results);
+
+    // GUIDs living on other WMI devices are queried one by one through their owner
+    if (remote && *results) {
+        IOReturn remoteRet = kIOReturnSuccess;
+        for (int i = 0; i < count; i++) {
+            if (blockIndices[i] != -2) {
+                if ((*results)->getObject(i) == kOSBooleanFalse && remoteRet == kIOReturnSuccess) {
+                    remoteRet = ret;
+                }
+                continue;
+            }
+            OSObject* value = nullptr;
+            IOReturn queryRet = queryBlock(requests[i].guid, requests[i].instanceIndex, &value);
+            if (value) {
+                (*results)->replaceObject(i, value);
+                value->release();
+            } else if (remoteRet == kIOReturnSuccess) {
+                remoteRet = queryRet != kIOReturnSuccess ? queryRet : kIOReturnNotFound;
+            }
+        }
+        ret = remoteRet;
+    }
+    IOFree(blockIndices, count * sizeof(int));
+
+    return ret;
+}
+
+/*
+ * Requests are grouped by block, so an expensive block has its collection
+ * enabled once for all of its instances. Grouped entries are marked done
+ * by setting their block index to -1.
+ */
+IOReturn VoodooWMIController::queryBlocksGated(const WMIQueryRequest* requests, int* blockIndices, int* count, OSArray** results) {
+    OSArray* array = OSArray::withCapacity(*count);
+    OSObject** values = (OSObject**) IOMallocZero(*count * sizeof(OSObject*));
+    if (!array || !values) {
+        OSSafeReleaseNULL(array);
+        if (values) {
+            IOFree(values, *count * sizeof(OSObject*));
+        }
+        return kIOReturnNoMemory;
+    }
+
+    IOReturn ret = kIOReturnSuccess;
+    for (int i = 0; i < *count; i++) {
+        int index = blockIndices[i];
+        if (index < 0) {
+            continue;
+        }
+        WMIBlock* block = table.getBlock(index);
+        bool collecting = false;
+        for (int j = i; j < *count; j++) {
+            if (blockIndices[j] != index) {
+                continue;
+            }
+            blockIndices[j] = -1;
+            if (cacheLookup(block, requests[j].instanceIndex, &values[j])) {
+                continue;
+            }
+            if ((block->flags & ACPI_WMI_EXPENSIVE) && !collecting) {
+                collecting = acquireCollection(block) == kIOReturnSuccess;
+            }
+            IOReturn queryRet = evaluateQuery(block, requests[j].instanceIndex, &values[j]);
+            if (queryRet != kIOReturnSuccess && ret == kIOReturnSuccess) {
+                ret = queryRet;
+            }
+        }
+        if (collecting) {
+            releaseCollection(block);
+        }
+    }
+
+    for (int i = 0; i < *count; i++) {
+        if (values[i]) {
+            array->setObject(values[i]);
+            values[i]->release();
+        } else {
+            array->setObject(kOSBooleanFalse);
+            if (ret == kIOReturnSuccess) {
+                ret = kIOReturnNotFound;
+            }
+        }
+    }
+    IOFree(values, *count * sizeof(OSObject*));
+
+    *results = array;
+    return ret;
+}
+
+/*
+ * The query cache is opt-in per GUID: QueryCacheTTL maps GUID strings to a
+ * time-to-live in milliseconds. Hits return the retained result of the last
+ * WQxx evaluation without touching AML.
+ */
+bool VoodooWMIController::loadQueryCache() {
+    if (!(cacheList = (WMIQueryCache**) IOMallocZero(table.getCount() * sizeof(WMIQueryCache*)))) {
+        return false;
+    }
+
+    OSDictionary* ttlDict = OSDynamicCast(OSDictionary, getProperty("QueryCacheTTL"));
+    if (!ttlDict || !ttlDict->getCount()) {
+        return true;
+    }
+
+    OSCollectionIterator* iterator = OSCollectionIterator::withCollection(ttlDict);
+    if (!iterator) {
+        return false;
+    }
+    while (OSSymbol* key = OSDynamicCast(OSSymbol, iterator->getNextObject())) {
+        OSNumber* ttl = OSDynamicCast(OSNumber, ttlDict->getObject(key));
+        WMIBlock* block = findBlock(WMIGuid::parse(key->getCStringNoCopy()));
+        if (!ttl || !block || (block->flags & ACPI_WMI_EVENT) || !block->instanceCount) {
+            DEBUG_LOG("%s::ignore query cache entry %s", getName(), key->getCStringNoCopy());
+            continue;
+        }
+        int index = table.getIndex(block);
+        if (cacheList[index]) {
+            continue;
+        }
+        WMIQueryCache* cache = (WMIQueryCache*) IOMallocZero(sizeof(WMIQueryCache) + block->instanceCount * sizeof(WMICacheEntry));
+        if (!cache) {
+            iterator->release();
+            return false;
+        }
+        nanoseconds_to_absolutetime(ttl->unsigned64BitValue() * kMillisecondScale, &cache->ttl);
+        cache->count = block->instanceCount;
+        cacheList[index] = cache;
+    }
+    iterator->release();
+
+    OSDictionary* statistics = OSDictionary::withCapacity(3);
+    cacheHits = OSNumber::withNumber(0ULL, 64);
+    cacheMisses = OSNumber::withNumber(0ULL, 64);
+    cacheEvictions = OSNumber::withNumber(0ULL, 64);
+    if (!statistics || !cacheHits || !cacheMisses || !cacheEvictions) {
+        OSSafeReleaseNULL(statistics);
+        return false;
+    }
+    // the counters are updated in place, readers of the property see live values
+    statistics->setObject("Hits", cacheHits);
+    statistics->setObject("Misses", cacheMisses);
+    statistics->setObject("Evictions", cacheEvictions);
+    setProperty("QueryCache", statistics);
+    statistics->release();
+
+    return true;
+}
+
+void VoodooWMIController::freeQueryCache() {
+    if (cacheList) {
+        for (int i = 0; i < table.getCount(); i++) {
+            if (WMIQueryCache* cache = cacheList[i]) {
+                for (int j = 0; j < cache->count; j++) {
+                    OSSafeReleaseNULL(cache->entries[j].value);
+                }
+                IOFree(cache, sizeof(WMIQueryCache) + cache->count * sizeof(WMICacheEntry));
+            }
+        }
+        IOFree(cacheList, table.getCount() * sizeof(WMIQueryCache*));
+        cacheList = nullptr;
+    }
+    OSSafeReleaseNULL(cacheHits);
+    OSSafeReleaseNULL(cacheMisses);
+    OSSafeReleaseNULL(cacheEvictions);
+}
+
+bool VoodooWMIController::cacheLookup(WMIBlock* block, UInt8 instanceIndex, OSObject** result) {
+    WMIQueryCache* cache = cacheList[table.getIndex(block)];
+    if (!cache || instanceIndex >= cache->count || !result) {
+        return false;
+    }
+
+    WMICacheEntry* entry = &cache->entries[instanceIndex];
+    UInt64 now;
+    clock_get_uptime(&now);
+    if (entry->value && now < entry->expiry) {
+        cacheHits->addValue(1);
+        entry->value->retain();
+        *result = entry->value;
+        return true;
+    }
+    cacheMisses->addValue(1);
+    return false;
+}
+
+void VoodooWMIController::cacheStore(WMIBlock* block, UInt8 instanceIndex, OSObject* value) {
+    WMIQueryCache* cache = cacheList[table.getIndex(block)];
+    if (!cache || instanceIndex >= cache->count || !value) {
+        return;
+    }
+
+    WMICacheEntry* entry = &cache->entries[instanceIndex];
+    if (entry->value) {
+        cacheEvictions->addValue(1);
+        entry->value->release();
+    }
+    value->retain();
+    entry->value = value;
+    clock_get_uptime(&entry->expiry);
+    entry->expiry += cache->ttl;
+}
+
+IOReturn VoodooWMIController::invalidateCache(WMIBlock* block) {
+    if (!cacheList[table.getIndex(block)]) {
+        return kIOReturnSuccess;
+    }
+    return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::invalidateCacheGated), block);
+}
+
+void VoodooWMIController::invalidateCacheGated(WMIBlock* block) {
+    WMIQueryCache* cache = cacheList[table.getIndex(block)];
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].value) {
+            cacheEvictions->addValue(1);
+            OSSafeReleaseNULL(cache->entries[i].value);
+        }
+    }
+}
+
+IOReturn VoodooWMIController::acquireBlockCollection(const WMIGuid& guid, OSObject* client) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, acquireBlockCollection(guid, client));
+    }
+    if (!(block->flags & ACPI_WMI_EXPENSIVE) || (block->flags & (ACPI_WMI_EVENT | ACPI_WMI_METHOD)) || !client) {
+        return kIOReturnInvalid;
+    }
+
+    return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::acquireClientCollection),
+                                  block, client);
+}
+
+IOReturn VoodooWMIController::releaseBlockCollection(const WMIGuid& guid, OSObject* client) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, releaseBlockCollection(guid, client));
+    }
+    if (!(block->flags & ACPI_WMI_EXPENSIVE) || (block->flags & (ACPI_WMI_EVENT | ACPI_WMI_METHOD)) || !client) {
+        return kIOReturnInvalid;
+    }
+
+    return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &VoodooWMIController::releaseClientCollection),
+                                  block, client);
+}
+
+/*
+ * Called inside the command gate, the hold of client on the block or
+ * nullptr. previous receives the link pointing to it.
+ */
+WMICollectHold* VoodooWMIController::findCollectHold(int index, OSObject* client, WMICollectHold*** previous) {
+    WMICollectHold** link = &collectHolds;
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->blockIndex == index && (*link)->client == client) {
+            break;
+        }
+    }
+    if (previous) {
+        *previous = link;
+    }
+    return *link;
+}
+
+IOReturn VoodooWMIController::acquireClientCollection(WMIBlock* block, OSObject* client) {
+    int index = table.getIndex(block);
+    WMICollectHold* hold = findCollectHold(index, client, nullptr);
+    if (!hold) {
+        if (!(hold = (WMICollectHold*) IOMallocZero(sizeof(WMICollectHold)))) {
+            return kIOReturnNoMemory;
+        }
+        hold->client = client;
+        hold->blockIndex = index;
+    }
+
+    IOReturn ret = acquireCollection(block);
+    if (ret == kIOReturnSuccess && !hold->count++) {
+        hold->next = collectHolds;
+        collectHolds = hold;
+    } else if (ret != kIOReturnSuccess && !hold->count) {
+        IOFree(hold, sizeof(WMICollectHold));
+    }
+    return ret;
+}
+
+IOReturn VoodooWMIController::releaseClientCollection(WMIBlock* block, OSObject* client) {
+    WMICollectHold** link;
+    WMICollectHold* hold = findCollectHold(table.getIndex(block), client, &link);
+    if (!hold) {
+        return kIOReturnNotOpen;
+    }
+    if (!--hold->count) {
+        *link = hold->next;
+        IOFree(hold, sizeof(WMICollectHold));
+    }
+    return releaseCollection(block);
+}
+
+/*
+ * Collection of an expensive block is reference counted, so back to back
+ * queries and polling clients don't toggle WCxx around every WQxx.
+ * Must be called inside the command gate.
+ */
+IOReturn VoodooWMIController::acquireCollection(WMIBlock* block) {
+    WMICollectState* state = &collectList[table.getIndex(block)];
+    if (!state->enabled) {
+        IOReturn ret = setBlockEnable(block, true);
+        if (ret != kIOReturnSuccess) {
+            return ret;
+        }
+        state->enabled = true;
+    }
+    state->users++;
+    return kIOReturnSuccess;
+}
+
+IOReturn VoodooWMIController::releaseCollection(WMIBlock* block) {
+    WMICollectState* state = &collectList[table.getIndex(block)];
+    if (!state->users) {
+        return kIOReturnNotOpen;
+    }
+    if (--state->users) {
+        return kIOReturnSuccess;
+    }
+
+    clock_get_uptime(&state->lastUse);
+    if (!collectIdleTimeout) {
+        state->enabled = false;
+        return setBlockEnable(block, false);
+    }
+    collectTimer->setTimeoutMS(collectIdleTimeout);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Disable collection of blocks that stayed unused for the idle timeout and
+ * come back for the ones released in the meantime.
+ */
+void VoodooWMIController::collectTimerFired(IOTimerEventSource* sender) {
+    UInt64 now, nextDeadline = 0;
+    clock_get_uptime(&now);
+
+    for (int i = 0; i < table.getCount(); i++) {
+        WMICollectState* state = &collectList[i];
+        if (!state->enabled || state->users) {
+            continue;
+        }
+        UInt64 deadline = state->lastUse + collectIdleInterval;
+        if (deadline <= now) {
+            DEBUG_LOG("%s::disable idle collection of block %d", getName(), i);
+            state->enabled = false;
+            setBlockEnable(table.getBlock(i), false);
+        } else if (!nextDeadline || deadline < nextDeadline) {
+            nextDeadline = deadline;
+        }
+    }
+
+    if (nextDeadline) {
+        UInt64 remaining;
+        absolutetime_to_nanoseconds(nextDeadline - now, &remaining);
+        collectTimer->setTimeoutMS((UInt32) (remaining / kMillisecondScale) + 1);
+    }
+}
+
+IOReturn VoodooWMIController::evaluateMethod(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, evaluateMethod(guid, instanceIndex, methodId, inputData, result));
+    }
+    if (!(block->flags & ACPI_WMI_METHOD)) {
+        return kIOReturnInvalid;
+    }
+
+    return evaluateMethodBlock(block, instanceIndex, methodId, inputData, result);
+}
+
+IOReturn VoodooWMIController::evaluateMethod(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId,
+                                             const void* input, UInt32 inputLength, void* output, UInt32* outputLength) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, evaluateMethod(guid, instanceIndex, methodId, input, inputLength, output, outputLength));
+    }
+    if (!(block->flags & ACPI_WMI_METHOD)) {
+        return kIOReturnInvalid;
+    }
+    if ((inputLength && !input) || (outputLength && *outputLength && !output)) {
+        return kIOReturnBadArgument;
+    }
+
+    OSData* inputData = nullptr;
+    if (inputLength && !(inputData = OSData::withBytesNoCopy(const_cast<void*>(input), inputLength))) {
+        return kIOReturnNoMemory;
+    }
+    OSObject* result = nullptr;
+    IOReturn ret = evaluateMethodBlock(block, instanceIndex, methodId, inputData, outputLength ? &result : nullptr);
+    if (ret == kIOReturnSuccess && outputLength) {
+        ret = wmi_copy_result(result, output, outputLength);
+    }
+    OSSafeReleaseNULL(result);
+    OSSafeReleaseNULL(inputData);
+
+    return ret;
+}
+
+IOReturn VoodooWMIController::evaluateMethodBlock(WMIBlock* block, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result) {
+    OSNumber* instance = argumentCache.copyInstance(instanceIndex);
+    OSNumber* method = argumentCache.copyMethod(methodId);
+    if (!instance || !method) {
+        OSSafeReleaseNULL(instance);
+        OSSafeReleaseNULL(method);
+        return kIOReturnNoMemory;
+    }
+    OSObject* argumentList[] = {
+        instance,
+        method,
+        inputData
+    };
+    IOReturn ret = evaluateBlockObject(block, kWMIStatMethod, methodList[table.getIndex(block)].method, result, argumentList, 3);
+    instance->release();
+    method->release();
+    invalidateCache(block);
+    return ret;
+}
+
+IOReturn VoodooWMIController::evaluateMethodAsync(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData,
+                                                  WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, evaluateMethodAsync(guid, instanceIndex, methodId, inputData, priority, target, action, refcon));
+    }
+    if (!(block->flags & ACPI_WMI_METHOD)) {
+        return kIOReturnInvalid;
+    }
+
+    WMIAsyncRequest* request = (WMIAsyncRequest*) IOMallocZero(sizeof(WMIAsyncRequest));
+    if (!request) {
+        return kIOReturnNoMemory;
+    }
+    request->block = block;
+    request->instanceIndex = instanceIndex;
+    request->methodId = methodId;
+    request->inputData = inputData;
+    request->target = target;
+    request->action = action;
+    request->refcon = refcon;
+    return enqueueRequest(request, priority);
+}
+
+IOReturn VoodooWMIController::queryBlockAsync(const WMIGuid& guid, UInt8 instanceIndex,
+                                              WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon) {
+    WMIBlock* block = nullptr;
+    if (!(block = findBlock(guid))) {
+        ROUTE_TO_GUID_OWNER(guid, queryBlockAsync(guid, instanceIndex, priority, target, action, refcon));
+    }
+    if (!(block->flags & (ACPI_WMI_STRING | ACPI_WMI_EXPENSIVE))) {
+        return kIOReturnInvalid;
+    }
+
+    WMIAsyncRequest* request = (WMIAsyncRequest*) IOMallocZero(sizeof(WMIAsyncRequest));
+    if (!request) {
+        return kIOReturnNoMemory;
+    }
+    request->block = block;
+    request->isQuery = true;
+    request->instanceIndex = instanceIndex;
+    request->target = target;
+    request->action = action;
+    request->refcon = refcon;
+    return enqueueRequest(request, priority);
+}
+
+bool VoodooWMIController::initRequestQueues() {
+    static const char* names[kWMIPriorityCount] = {"Interactive", "Normal", "Background"};
+
+    if (!(requestLock = IOLockAlloc())) {
+        return false;
+    }
+    OSDictionary* statistics = OSDictionary::withCapacity(kWMIPriorityCount);
+    if (!statistics) {
+        return false;
+    }
+    for (int i = 0; i < kWMIPriorityCount; i++) {
+        WMIRequestQueue* queue = &requestQueues[i];
+        OSDictionary* dict = OSDictionary::withCapacity(5);
+        queue->depthNumber = OSNumber::withNumber(0ULL, 32);
+        queue->maxDepthNumber = OSNumber::withNumber(0ULL, 32);
+        queue->completedNumber = OSNumber::withNumber(0ULL, 64);
+        queue->totalWaitNumber = OSNumber::withNumber(0ULL, 64);
+        queue->maxWaitNumber = OSNumber::withNumber(0ULL, 64);
+        if (!dict || !queue->depthNumber || !queue->maxDepthNumber || !queue->completedNumber ||
+            !queue->totalWaitNumber || !queue->maxWaitNumber) {
+            OSSafeReleaseNULL(dict);
+            statistics->release();
+            return false;
+        }
+        dict->setObject("Depth", queue->depthNumber);
+        dict->setObject("MaxDepth", queue->maxDepthNumber);
+        dict->setObject("Completed", queue->completedNumber);
+        dict->setObject("TotalWaitUS", queue->totalWaitNumber);
+        dict->setObject("MaxWaitUS", queue->maxWaitNumber);
+        statistics->setObject(names[i], dict);
+        dict->release();
+    }
+    setProperty("RequestQueue", statistics);
+    statistics->release();
+
+    return true;
+}
+
+void VoodooWMIController::freeRequestQueues() {
+    WMIRequestPriority priority;
+    while (WMIAsyncRequest* request = dequeueRequest(&priority)) {
+        completeRequest(request, kIOReturnAborted, nullptr);
+    }
+    for (int i = 0; i < kWMIPriorityCount; i++) {
+        WMIRequestQueue* queue = &requestQueues[i];
+        OSSafeReleaseNULL(queue->depthNumber);
+        OSSafeReleaseNULL(queue->maxDepthNumber);
+        OSSafeReleaseNULL(queue->completedNumber);
+        OSSafeReleaseNULL(queue->totalWaitNumber);
+        OSSafeReleaseNULL(queue->maxWaitNumber);
+    }
+    if (requestLock) {
+        IOLockFree(requestLock);
+        requestLock = nullptr;
+    }
+}
+
+IOReturn VoodooWMIController::enqueueRequest(WMIAsyncRequest* request, WMIRequestPriority priority) {
+    if (priority < 0 || priority >= kWMIPriorityCount) {
+        priority = kWMIPriorityNormal;
+    }
+    if (request->inputData) {
+        request->inputData->retain();
+    }
+    if (request->target) {
+        request->target->retain();
+    }
+    clock_get_uptime(&request->enqueueTime);
+
+    IOLockLock(requestLock);
+    WMIRequestQueue* queue = &requestQueues[priority];
+    if (queue->tail) {
+        queue->tail->next = request;
+    } else {
+        queue->head = request;
+    }
+    queue->tail = request;
+    queue->depth++;
+    queue->depthNumber->setValue(queue->depth);
+    if (queue->depth > queue->maxDepthNumber->unsigned32BitValue()) {
+        queue->maxDepthNumber->setValue(queue->depth);
+    }
+    IOLockUnlock(requestLock);
+
+    requestSource->interruptOccurred(nullptr, this, 0);
+    return kIOReturnSuccess;
+}
+
+WMIAsyncRequest* VoodooWMIController::dequeueRequest(WMIRequestPriority* priority) {
+    WMIAsyncRequest* request = nullptr;
+    if (!requestLock) {
+        return nullptr;
+    }
+
+    IOLockLock(requestLock);
+    for (int i = 0; i < kWMIPriorityCount; i++) {
+        WMIRequestQueue* queue = &requestQueues[i];
+        if (!(request = queue->head)) {
+            continue;
+        }
+        if (!(queue->head = request->next)) {
+            queue->tail = nullptr;
+        }
+        queue->depth--;
+        queue->depthNumber->setValue(queue->depth);
+        *priority = (WMIRequestPriority) i;
+        break;
+    }
+    IOLockUnlock(requestLock);
+
+    return request;
+}
+
+void VoodooWMIController::completeRequest(WMIAsyncRequest* request, IOReturn status, OSObject* result) {
+    if (request->action) {
+        request->action(request->target, request->refcon, status, result);
+    }
+    OSSafeReleaseNULL(result);
+    OSSafeReleaseNULL(request->inputData);
+    OSSafeReleaseNULL(request->target);
+    IOFree(request, sizeof(WMIAsyncRequest));
+}
+
+/*
+ * Runs on the work loop. Only one request is taken at a time so a request
+ * queued with a higher priority meanwhile is serviced next.
+ */
+void VoodooWMIController::serviceRequests() {
+    WMIRequestPriority priority;
+    while (WMIAsyncRequest* request = dequeueRequest(&priority)) {
+        UInt64 now, wait;
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - request->enqueueTime, &wait);
+        wait /= 1000;
+
+        WMIRequestQueue* queue = &requestQueues[priority];
+        queue->completedNumber->addValue(1);
+        queue->totalWaitNumber->addValue(wait);
+        if (wait > queue->maxWaitNumber->unsigned64BitValue()) {
+            queue->maxWaitNumber->setValue(wait);
+        }
+
+        OSObject* result = nullptr;
+        IOReturn ret;
+        if (request->isQuery) {
+            ret = queryBlockGated(request->block, &request->instanceIndex, &result);
+        } else {
+            ret = evaluateMethodBlock(request->block, request->instanceIndex, request->methodId, request->inputData, &result);
+        }
+        completeRequest(request, ret, result);
+    }
+}
+
+void VoodooWMIController::requestQueueAction(OSObject* owner, IOInterruptEventSource* sender, int count) {
+    if (VoodooWMIController* controller = OSDynamicCast(VoodooWMIController, owner)) {
+        controller->serviceRequests();
+    }
+}
+
+IOReturn VoodooWMIControllerUserClient::externalMethod(uint32_t selector,
+                                                       IOExternalMethodArguments* arguments,
+                                                       IOExternalMethodDispatch* dispatch,
+                                                       OSObject* target,
+                                                       void* reference) {
+    VoodooWMIController* controller = OSDynamicCast(VoodooWMIController, getProvider());
+    if (!controller) {
+        return kIOReturnError;
+    }
+
+    if (selector == kWMIControllerSelectorResetStatistics) {
+        controller->resetStatistics();
+        return kIOReturnSuccess;
+    }
+    if (selector == kWMIControllerSelectorSetCaptureMode) {
+        IOReturn ret = clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+        if (ret != kIOReturnSuccess) {
+            return ret;
+        }
+        if (arguments->scalarInputCount != 1) {
+            return kIOReturnBadArgument;
+        }
+        return controller->setCaptureEnabled(arguments->scalarInput[0] != 0);
+    }
+    if (selector == kWMIControllerSelectorInjectEvent) {
+        // replayed events trigger real hotkey actions
+        IOReturn ret = clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+        if (ret != kIOReturnSuccess) {
+            return ret;
+        }
+        if (arguments->structureInputSize != sizeof(WMICaptureRecord)) {
+            return kIOReturnBadArgument;
+        }
+        return controller->injectEvent(static_cast<const WMICaptureRecord*>(arguments->structureInput));
+    }
+    return kIOReturnNotFound;
+}
+
+IOReturn VoodooWMIControllerUserClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) {
+    VoodooWMIController* controller = OSDynamicCast(VoodooWMIController, getProvider());
+    if (!controller) {
+        return kIOReturnError;
+    }
+
+    if (type == kWMIControllerMemoryCapture) {
+        // the ring holds raw _WED payloads of every event
+        IOReturn ret = clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+        if (ret != kIOReturnSuccess) {
+            return ret;
+        }
+        *options = kIOMapReadOnly;
+        return controller->copyCaptureMemory(memory);
+    }
+    return kIOReturnUnsupported;
+}
+
+IOReturn VoodooWMIControllerUserClient::clientClose() {
+    if (!isInactive()) {
+        terminate();
+    }
+    return kIOReturnSuccess;
 }
@@ -2,70 +2,446 @@
 #define VoodooWMIController_hpp
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include "WMIBlockTable.hpp"
+#include "WMIArgumentCache.hpp"
+#include "ControllerInterface.h"
 
-/*
- * If the GUID data block is marked as expensive, we must enable and
- * explicitily disable data collection.
- */
-#define ACPI_WMI_EXPENSIVE   0x1
-#define ACPI_WMI_METHOD      0x2    /* GUID is a method */
-#define ACPI_WMI_STRING      0x4    /* GUID takes & returns a string */
-#define ACPI_WMI_EVENT       0x8    /* GUID is an event */
+enum WMIRequestPriority {
+    kWMIPriorityInteractive,    /* user facing, e.g. hotkey driven methods */
+    kWMIPriorityNormal,
+    kWMIPriorityBackground,     /* telemetry polls */
+    kWMIPriorityCount
+};
+
+/* Completion of an asynchronous request, result is released after the call returns */
+typedef void (*WMICompletionAction)(OSObject* target, void* refcon, IOReturn status, OSObject* result);
+
+/* Size of the deferred event queue, must be a power of two */
+#define WMI_EVENT_QUEUE_SIZE 64
+
+/* An event captured in the ACPI notification context, delivered later on the work loop */
+struct WMIEventRecord {
+    UInt64 timestamp;
+    WMIEventData eventData; /* its object is retained */
+    UInt8 notifyId;
+};
+
+/* ACPI method names of a block, interned once, nullptr if not applicable */
+struct WMIBlockMethods {
+    const OSSymbol* eventEnable;    /* WExx */
+    const OSSymbol* collectEnable;  /* WCxx */
+    const OSSymbol* query;          /* WQxx */
+    const OSSymbol* set;            /* WSxx */
+    const OSSymbol* method;         /* WMxx */
+};
+
+/* One (GUID, instance) pair of a batched query */
+struct WMIQueryRequest {
+    WMIGuid guid;
+    UInt8 instanceIndex;
+};
+
+/* A queued asynchronous WQxx or WMxx evaluation */
+struct WMIAsyncRequest {
+    WMIAsyncRequest* next;
+    WMIBlock* block;
+    bool isQuery;
+    UInt8 instanceIndex;
+    UInt32 methodId;
+    OSObject* inputData;            /* retained */
+    OSObject* target;               /* retained */
+    WMICompletionAction action;
+    void* refcon;
+    UInt64 enqueueTime;
+};
+
+/* FIFO of one priority, statistics are published in place */
+struct WMIRequestQueue {
+    WMIAsyncRequest* head;
+    WMIAsyncRequest* tail;
+    UInt32 depth;
+    OSNumber* depthNumber;
+    OSNumber* maxDepthNumber;
+    OSNumber* completedNumber;
+    OSNumber* totalWaitNumber;      /* us */
+    OSNumber* maxWaitNumber;        /* us */
+};
+
+/* Size of the GUID routing table shared by all controllers */
+#define WMI_GUID_ROUTE_SIZE 1024
+
+class VoodooWMIController;
+
+/* The provider of a controller as the device of the portable core */
+class WMIACPIDevice : public WMIDevice {
+    VoodooWMIController* controller;
+
+ public:
+    explicit WMIACPIDevice(VoodooWMIController* controller) : controller(controller) {}
+
+    IOReturn evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) override;
+    void release(WMIEventData* result) override;
+};
+
+/* Statistics, capture, logging and deferred delivery of a controller's notifications */
+class WMIControllerHooks : public WMIDispatchHooks {
+    VoodooWMIController* controller;
+
+ public:
+    explicit WMIControllerHooks(VoodooWMIController* controller) : controller(controller) {}
+
+    bool wantsEventData(UInt8 notifyId, int index) override;
+    void onEventData(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status) override;
+    bool deferEvent(UInt8 notifyId, int index, const WMIEventData* eventData) override;
+    void callHandler(int index, const WMIEventHandler* handler, WMIBlock* block, const WMIEventData* eventData) override;
+};
+
+/* A GUID of an attached WMI device, deleted marks a freed slot on a probe chain */
+struct WMIGuidRoute {
+    WMIGuid guid;
+    VoodooWMIController* owner;
+    bool deleted;
+};
+
+/* Timed operations of a block */
+enum WMIStatOp {
+    kWMIStatNotify,         /* whole ACPI notification */
+    kWMIStatEventData,      /* _WED */
+    kWMIStatHandler,        /* event subscribers */
+    kWMIStatQuery,          /* WQxx */
+    kWMIStatSet,            /* WSxx */
+    kWMIStatMethod,         /* WMxx */
+    kWMIStatEventEnable,    /* WExx */
+    kWMIStatCollectEnable,  /* WCxx */
+    kWMIStatCount
+};
+
+/* Bucket n counts latencies in [2^(n-1), 2^n) us, bucket 0 is under 1 us */
+#define WMI_LATENCY_BUCKETS 24
+
+/* Updated with atomics on the calling thread, never locked */
+struct WMIOpStats {
+    UInt64 count;
+    UInt64 totalTime;   /* ns */
+    UInt64 maxTime;     /* ns */
+    UInt32 histogram[WMI_LATENCY_BUCKETS];
+};
+
+struct WMIBlockStats {
+    WMIOpStats ops[kWMIStatCount];
+};
 
-struct WMIBlock {
-    char guid[16];
-    union {
-        char objectId[2];
-        struct {
-            UInt8 notifyId;
-            UInt8 reserved;
-        };
-    };
-    UInt8 instanceCount;
-    UInt8 flags;
+/* Data collection state of an expensive block, only touched inside the command gate */
+struct WMICollectState {
+    UInt32 users;       /* explicit acquires plus queries in flight */
+    bool enabled;       /* WCxx(1) evaluated and not yet undone */
+    UInt64 lastUse;     /* uptime of the last release */
 };
 
-typedef void (*WMIEventAction)(OSObject* target, WMIBlock* block, OSObject* eventData);
+/* Explicit acquires of a block by one client, only touched inside the command gate */
+struct WMICollectHold {
+    WMICollectHold* next;
+    OSObject* client;   /* not retained, only compared */
+    int blockIndex;
+    UInt32 count;
+};
+
+/* A retained queryBlock result, only touched inside the command gate */
+struct WMICacheEntry {
+    OSObject* value;
+    UInt64 expiry;      /* uptime after which the value is stale */
+};
 
-struct WMIEventHandler {
-    OSObject* target;
-    WMIEventAction action;
+/* Per block query cache, allocated only for blocks with a configured TTL */
+struct WMIQueryCache {
+    UInt64 ttl;         /* absolute time */
+    int count;          /* instanceCount of the block */
+    WMICacheEntry entries[];
 };
 
 class VoodooWMIController : public IOService {
     OSDeclareDefaultStructors(VoodooWMIController)
 
     bool debug = false;
+    bool deferredDelivery = false;
+    bool allEventsEnabled = false;
+    UInt32 blockPropertiesPublished = 0;
 
     IOACPIPlatformDevice* device = nullptr;
-    WMIBlock* blockList = nullptr;
-    WMIEventHandler* handlerList = nullptr;
-    int blockCount = 0;
+    WMIACPIDevice acpiDevice{this};
+    WMIControllerHooks dispatchHooks{this};
+    IOWorkLoop* workLoop = nullptr;
+    IOInterruptEventSource* eventSource = nullptr;
+    IOCommandGate* commandGate = nullptr;
+    IOInterruptEventSource* requestSource = nullptr;
+    IOLock* requestLock = nullptr;
+    WMIRequestQueue requestQueues[kWMIPriorityCount] = {};
+    IOTimerEventSource* collectTimer = nullptr;
+    UInt32 collectIdleTimeout = 0;  /* ms, 0 disables collection right after use */
+    UInt64 collectIdleInterval = 0; /* collectIdleTimeout in absolute time */
+    WMIBlockTable table;
+    IOLock* subscriberLock = nullptr;   /* serializes registrations */
+    WMIBlockMethods* methodList = nullptr;
+    WMICollectState* collectList = nullptr;
+    WMICollectHold* collectHolds = nullptr;
+
+    WMIArgumentCache<OSNumber> argumentCache;
+    WMIQueryCache** cacheList = nullptr;
+    OSNumber* cacheHits = nullptr;
+    OSNumber* cacheMisses = nullptr;
+    OSNumber* cacheEvictions = nullptr;
+    const OSSymbol* eventDataMethod = nullptr;  /* _WED */
+    WMIBlockStats* statList = nullptr;
+    UInt64 unknownNotifyCount = 0;
+
+    /*
+     * Single producer (message) single consumer (work loop) ring, the
+     * indices run freely and are masked on access.
+     */
+    WMIEventRecord eventQueue[WMI_EVENT_QUEUE_SIZE];
+    UInt32 eventQueueHead = 0;
+    UInt32 eventQueueTail = 0;
+    UInt32 eventQueueOverflow = 0;
+    UInt32 publishedOverflow = 0;
+
+    /* Event capture for userspace tools, the ring lives until stop once allocated */
+    bool captureEnabled = false;
+    IOBufferMemoryDescriptor* captureMemory = nullptr;
+    WMICaptureRing* captureRing = nullptr;
+
+    static WMIGuidRoute guidRoutes[WMI_GUID_ROUTE_SIZE];
+    static IOLock* guidRouteLock;
+    static IOLock* getGuidRouteLock();
+    static VoodooWMIController* lookupGuidRoute(const WMIGuid& guid);
+    void registerGuidRoutes();
+    void unregisterGuidRoutes();
+
+    /*
+     * Calls other controllers routed into this one. They only start while
+     * the routes are registered, stop() waits for them after unregistering.
+     */
+    SInt32 routedCalls = 0;
+    VoodooWMIController* beginRoutedCall(const WMIGuid& guid);
+    void endRoutedCall();
+
+    /* message() calls in progress, none start once notifyClosed is set */
+    SInt32 notifyCalls = 0;
+    bool notifyClosed = false;
+
+    bool startController();
+    void stopController();
 
     bool loadBlocks();
-    WMIBlock* findBlock(const char* guid);
+    void publishBlockProperties();
+    void setAllEventsEnabled(bool enabled);
+    bool buildMethodList();
+    void freeMethodList();
+    WMIBlock* findBlock(const WMIGuid& guid);
+
+    void recordStat(int index, WMIStatOp op, UInt64 startTime);
+    void publishStatistics();
+    IOReturn evaluateBlockObject(WMIBlock* block, WMIStatOp op, const OSSymbol* method,
+                                 OSObject** result, OSObject** argumentList, UInt32 argumentCount);
+
+    IOReturn setEventEnable(WMIBlock* block, bool enabled);
+    IOReturn setBlockEnable(WMIBlock* block, bool enabled);
+
+    IOReturn acquireCollection(WMIBlock* block);
+    IOReturn releaseCollection(WMIBlock* block);
+    WMICollectHold* findCollectHold(int index, OSObject* client, WMICollectHold*** previous);
+    IOReturn acquireClientCollection(WMIBlock* block, OSObject* client);
+    IOReturn releaseClientCollection(WMIBlock* block, OSObject* client);
+    void collectTimerFired(IOTimerEventSource* sender);
+    IOReturn queryBlockGated(WMIBlock* block, UInt8* instanceIndex, OSObject** result);
+    IOReturn queryBlocksGated(const WMIQueryRequest* requests, int* blockIndices, int* count, OSArray** results);
+    IOReturn evaluateQuery(WMIBlock* block, UInt8 instanceIndex, OSObject** result);
 
-    IOReturn setEventEnable(const char* guid, bool enabled);
-    IOReturn setBlockEnable(const char* guid, bool enabled);
+    IOReturn evaluateMethodBlock(WMIBlock* block, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result);
+
+    bool initRequestQueues();
+    void freeRequestQueues();
+    IOReturn enqueueRequest(WMIAsyncRequest* request, WMIRequestPriority priority);
+    WMIAsyncRequest* dequeueRequest(WMIRequestPriority* priority);
+    void completeRequest(WMIAsyncRequest* request, IOReturn status, OSObject* result);
+    void serviceRequests();
+    static void requestQueueAction(OSObject* owner, IOInterruptEventSource* sender, int count);
+
+    bool loadQueryCache();
+    void freeQueryCache();
+    bool cacheLookup(WMIBlock* block, UInt8 instanceIndex, OSObject** result);
+    void cacheStore(WMIBlock* block, UInt8 instanceIndex, OSObject* value);
+    IOReturn invalidateCache(WMIBlock* block);
+    void invalidateCacheGated(WMIBlock* block);
 
     IOReturn getEventData(UInt8 notifyId, OSObject** result);
+    friend class WMIACPIDevice;
+
+    void logEvent(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status);
+    bool deferEvent(UInt8 notifyId, const WMIEventData* eventData);
+    friend class WMIControllerHooks;
+
+    bool enqueueEvent(UInt8 notifyId, const WMIEventData* eventData);
+    void drainEventQueue();
+    bool allocateCaptureRing();
+    void captureEvent(UInt8 notifyId, int index, const WMIEventData* eventData);
+    IOReturn injectEventGated(UInt8* notifyId, WMIEventData* eventData);
+    static void eventQueueAction(OSObject* owner, IOInterruptEventSource* sender, int count);
 
  public:
     IOService* probe(IOService* provider, SInt32* score) override;
     bool start(IOService* provider) override;
     void stop(IOService* provider) override;
+    IOWorkLoop* getWorkLoop() const override;
+    bool serializeProperties(OSSerialize* serialize) const override;
+    using IOService::copyProperty;
+    OSObject* copyProperty(const char* aKey) const override;
+    IOReturn setProperties(OSObject* properties) override;
     IOReturn message(UInt32 type, IOService* provider, void* argument) override;
 
-    bool hasGuid(const char* guid);
+    /* Zero the counters behind the WMI-Statistics property */
+    void resetStatistics();
 
-    IOReturn registerWMIEvent(const char* guid, OSObject* target, WMIEventAction handler);
-    IOReturn unregisterWMIEvent(const char* guid);
+    /* Append every notification to the capture ring, see ControllerInterface.h */
+    IOReturn setCaptureEnabled(bool enabled);
+    IOReturn copyCaptureMemory(IOMemoryDescriptor** memory);
 
-    IOReturn setBlock(const char* guid, UInt8 instanceIndex, OSObject* inputData);
-    IOReturn queryBlock(const char* guid, UInt8 instanceIndex, OSObject** result);
+    /*
+     * Deliver a recorded notification to the subscribers as if the firmware
+     * had raised it, without evaluating _WED. Runs on the work loop.
+     */
+    IOReturn injectEvent(const WMICaptureRecord* record);
+
+    /*
+     * Whether this WMI device has the GUID. The other calls taking a GUID
+     * are forwarded to whichever attached device has it.
+     */
+    bool hasGuid(const WMIGuid& guid);
+    bool hasGuid(const char* guid) { return hasGuid(WMIGuid::parse(guid)); }
+
+    /*
+     * Copy up to capacity distinct GUIDs of this WMI device in ascending raw
+     * byte order, returns how many there are in total.
+     */
+    int getBlockGuids(WMIGuid* guids, int capacity);
+
+    /* The controller of any attached WMI device having the GUID, retained */
+    static VoodooWMIController* copyControllerForGuid(const WMIGuid& guid);
+
+    /*
+     * unregisterWMIEvent returns once no call into target is in flight, so
+     * target may go away right after. Never call it from the handler itself.
+     */
+    IOReturn registerWMIEvent(const WMIGuid& guid, OSObject* target, WMIEventAction handler);
+    IOReturn unregisterWMIEvent(const WMIGuid& guid, OSObject* target);
+    IOReturn registerWMIEvent(const char* guid, OSObject* target, WMIEventAction handler) {
+        return registerWMIEvent(WMIGuid::parse(guid), target, handler);
+    }
+    IOReturn unregisterWMIEvent(const char* guid, OSObject* target) {
+        return unregisterWMIEvent(WMIGuid::parse(guid), target);
+    }
+
+    IOReturn setBlock(const WMIGuid& guid, UInt8 instanceIndex, OSObject* inputData);
+    IOReturn queryBlock(const WMIGuid& guid, UInt8 instanceIndex, OSObject** result);
+    IOReturn setBlock(const char* guid, UInt8 instanceIndex, OSObject* inputData) {
+        return setBlock(WMIGuid::parse(guid), instanceIndex, inputData);
+    }
+    IOReturn queryBlock(const char* guid, UInt8 instanceIndex, OSObject** result) {
+        return queryBlock(WMIGuid::parse(guid), instanceIndex, result);
+    }
+
+    /*
+     * Query several (GUID, instance) pairs in one pass. results holds one
+     * entry per request in request order, kOSBooleanFalse for failed ones,
+     * and the first failure is returned.
+     */
+    IOReturn queryBlocks(const WMIQueryRequest* requests, int count, OSArray** results);
+
+    /*
+     * Keep data collection of an expensive block enabled between queries.
+     * Holds are counted per client, which can only release its own,
+     * kIOReturnNotOpen if it holds none.
+     */
+    IOReturn acquireBlockCollection(const WMIGuid& guid, OSObject* client);
+    IOReturn releaseBlockCollection(const WMIGuid& guid, OSObject* client);
+    IOReturn acquireBlockCollection(const char* guid, OSObject* client) {
+        return acquireBlockCollection(WMIGuid::parse(guid), client);
+    }
+    IOReturn releaseBlockCollection(const char* guid, OSObject* client) {
+        return releaseBlockCollection(WMIGuid::parse(guid), client);
+    }
+
+    IOReturn evaluateMethod(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result);
+    IOReturn evaluateMethod(const char* guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result) {
+        return evaluateMethod(WMIGuid::parse(guid), instanceIndex, methodId, inputData, result);
+    }
+
+    /*
+     * Evaluate a method on caller owned buffers. The input bytes are passed to
+     * AML without being copied, the result is copied into output and its size
+     * is returned in outputLength, kIOReturnOverrun if it doesn't fit.
+     */
+    IOReturn evaluateMethod(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId,
+                            const void* input, UInt32 inputLength, void* output, UInt32* outputLength);
+    IOReturn evaluateMethod(const char* guid, UInt8 instanceIndex, UInt32 methodId,
+                            const void* input, UInt32 inputLength, void* output, UInt32* outputLength) {
+        return evaluateMethod(WMIGuid::parse(guid), instanceIndex, methodId, input, inputLength, output, outputLength);
+    }
+
+    /* Evaluate a method with a packed request struct and expect a packed response struct back */
+    template <typename Request, typename Response>
+    IOReturn evaluateTypedMethod(const char* guid, UInt8 instanceIndex, UInt32 methodId, const Request& input, Response* output) {
+        return evaluateTypedMethod(WMIGuid::parse(guid), instanceIndex, methodId, input, output);
+    }
+    template <typename Request, typename Response>
+    IOReturn evaluateTypedMethod(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId, const Request& input, Response* output) {
+        static_assert(__is_trivially_copyable(Request), "WMI request must be a plain struct");
+        static_assert(__is_trivially_copyable(Response), "WMI response must be a plain struct");
+        UInt32 length = sizeof(Response);
+        IOReturn ret = evaluateMethod(guid, instanceIndex, methodId, &input, sizeof(Request), output, &length);
+        if (ret == kIOReturnSuccess && length != sizeof(Response)) {
+            return kIOReturnUnderrun;
+        }
+        return ret;
+    }
+
+    /*
+     * Queue the evaluation and return immediately. Requests are serviced on
+     * the controller work loop, higher priorities first, and action is called
+     * there with the outcome.
+     */
+    IOReturn evaluateMethodAsync(const WMIGuid& guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData,
+                                 WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon);
+    IOReturn queryBlockAsync(const WMIGuid& guid, UInt8 instanceIndex,
+                             WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon);
+    IOReturn evaluateMethodAsync(const char* guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData,
+                                 WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon) {
+        return evaluateMethodAsync(WMIGuid::parse(guid), instanceIndex, methodId, inputData, priority, target, action, refcon);
+    }
+    IOReturn queryBlockAsync(const char* guid, UInt8 instanceIndex,
+                             WMIRequestPriority priority, OSObject* target, WMICompletionAction action, void* refcon) {
+        return queryBlockAsync(WMIGuid::parse(guid), instanceIndex, priority, target, action, refcon);
+    }
+};
+
+
+
+class VoodooWMIControllerUserClient : public IOUserClient {
+    OSDeclareDefaultStructors(VoodooWMIControllerUserClient);
+
+ public:
+    IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
+                            IOExternalMethodDispatch* dispatch = 0, OSObject* target = 0, void* reference = 0) override;
+    IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) override;
 
-    IOReturn evaluateMethod(const char* guid, UInt8 instanceIndex, UInt32 methodId, OSObject* inputData, OSObject** result);
+    IOReturn clientClose() override;
 };
 
 #endif /* VoodooWMIController_hpp */
@@ -0,0 +1,124 @@
+#ifndef WMIArgumentCache_hpp
+#define WMIArgumentCache_hpp
+
+#include "WMIBlockTable.hpp"
+
+/*
+ * Immutable argument objects shared by all evaluations: the enable flags,
+ * the instance indices up to the largest instanceCount, the notify IDs of
+ * the event blocks and the method IDs below WMI_CACHED_METHOD_IDS. The copy functions hand out a reference to one of
+ * them, falling back to a fresh number for uncommon values, and the caller
+ * releases it either way.
+ *
+ * Number is OSNumber in the kext, anything with its withNumber(), retain()
+ * and release() will do.
+ */
+/* Method IDs are small in practice, firmware numbers them from 0 or 1 */
+#define WMI_CACHED_METHOD_IDS 32
+
+template <typename Number>
+class WMIArgumentCache {
+    Number* flagArguments[2] = {};
+    Number** instanceArguments = nullptr;
+    int instanceArgumentCount = 0;
+    Number* notifyArguments[256] = {};
+    Number* methodArguments[WMI_CACHED_METHOD_IDS] = {};
+
+    static void releaseNull(Number*& number) {
+        if (number) {
+            number->release();
+            number = nullptr;
+        }
+    }
+
+ public:
+    /* Build the arguments for the blocks of a loaded table, call free() on failure too */
+    bool init(const WMIBlockTable& table) {
+        if (!(flagArguments[0] = Number::withNumber(0ULL, 8)) ||
+            !(flagArguments[1] = Number::withNumber(1ULL, 8))) {
+            return false;
+        }
+
+        for (int i = 0; i < WMI_CACHED_METHOD_IDS; i++) {
+            if (!(methodArguments[i] = Number::withNumber(i, 32))) {
+                return false;
+            }
+        }
+
+        int count = 0;
+        for (int i = 0; i < table.getCount(); i++) {
+            WMIBlock* block = table.getBlock(i);
+            if (block->instanceCount > count) {
+                count = block->instanceCount;
+            }
+            if ((block->flags & ACPI_WMI_EVENT) && !notifyArguments[block->notifyId] &&
+                !(notifyArguments[block->notifyId] = Number::withNumber(block->notifyId, 8))) {
+                return false;
+            }
+        }
+
+        if (count) {
+            if (!(instanceArguments = (Number**) wmi_alloc(count * sizeof(Number*)))) {
+                return false;
+            }
+            instanceArgumentCount = count;
+            for (int i = 0; i < count; i++) {
+                if (!(instanceArguments[i] = Number::withNumber(i, 8))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void free() {
+        releaseNull(flagArguments[0]);
+        releaseNull(flagArguments[1]);
+        for (int i = 0; i < 256; i++) {
+            releaseNull(notifyArguments[i]);
+        }
+        for (int i = 0; i < WMI_CACHED_METHOD_IDS; i++) {
+            releaseNull(methodArguments[i]);
+        }
+        if (instanceArguments) {
+            for (int i = 0; i < instanceArgumentCount; i++) {
+                releaseNull(instanceArguments[i]);
+            }
+            wmi_free(instanceArguments, instanceArgumentCount * sizeof(Number*));
+            instanceArguments = nullptr;
+        }
+        instanceArgumentCount = 0;
+    }
+
+    Number* copyFlag(bool enabled) {
+        Number* argument = flagArguments[enabled ? 1 : 0];
+        argument->retain();
+        return argument;
+    }
+
+    Number* copyInstance(UInt8 instanceIndex) {
+        if (instanceIndex < instanceArgumentCount) {
+            instanceArguments[instanceIndex]->retain();
+            return instanceArguments[instanceIndex];
+        }
+        return Number::withNumber(instanceIndex, 8);
+    }
+
+    Number* copyMethod(UInt32 methodId) {
+        if (methodId < WMI_CACHED_METHOD_IDS) {
+            methodArguments[methodId]->retain();
+            return methodArguments[methodId];
+        }
+        return Number::withNumber(methodId, 32);
+    }
+
+    Number* copyNotify(UInt8 notifyId) {
+        if (Number* argument = notifyArguments[notifyId]) {
+            argument->retain();
+            return argument;
+        }
+        return Number::withNumber(notifyId, 8);
+    }
+};
+
+#endif /* WMIArgumentCache_hpp */
@@ -0,0 +1,221 @@
+#include "WMIBlockTable.hpp"
+
+bool WMIBlockTable::load(const void* data, UInt32 length) {
+    if (!data || length % sizeof(WMIBlock) != 0 || !(blockCount = length / sizeof(WMIBlock))) {
+        blockCount = 0;
+        return false;
+    }
+
+    if (!(blockList = (WMIBlock*) wmi_alloc(blockCount * sizeof(WMIBlock))) ||
+        !(subscriberList = (WMISubscriberList**) wmi_alloc(blockCount * sizeof(WMISubscriberList*))) ||
+        !(guidIndex = (int*) wmi_alloc(blockCount * sizeof(int)))) {
+        unload();
+        return false;
+    }
+    memcpy(blockList, data, length);
+
+    buildGuidIndex();
+    buildNotifyIndex();
+    return true;
+}
+
+bool WMIBlockTable::load(WMIDevice* device) {
+    WMIEventData data;
+    if (device->evaluate("_WDG", nullptr, 0, &data) != kIOReturnSuccess) {
+        return false;
+    }
+    bool loaded = data.type == kWMIEventDataBuffer && load(data.getBytes(), data.length);
+    device->release(&data);
+    return loaded;
+}
+
+/*
+ * Dispatch must have stopped, every remaining snapshot is freed.
+ */
+void WMIBlockTable::unload() {
+    if (subscriberList) {
+        for (int i = 0; i < blockCount; i++) {
+            publishSubscribers(i, nullptr);
+        }
+        reclaimSubscribers(true);
+        wmi_free(subscriberList, blockCount * sizeof(WMISubscriberList*));
+        subscriberList = nullptr;
+    }
+    if (blockList) {
+        wmi_free(blockList, blockCount * sizeof(WMIBlock));
+        blockList = nullptr;
+    }
+    if (guidIndex) {
+        wmi_free(guidIndex, blockCount * sizeof(int));
+        guidIndex = nullptr;
+    }
+    memset(notifyIndex, 0xff, sizeof(notifyIndex));
+    blockCount = 0;
+}
+
+/*
+ * Sort block indices by raw GUID so lookups are a binary search over
+ * 16-byte keys instead of formatting every block's GUID as a string.
+ * Duplicated GUIDs keep their _WDG order, the first one wins.
+ */
+void WMIBlockTable::buildGuidIndex() {
+    for (int i = 0; i < blockCount; i++) {
+        int j = i;
+        while (j > 0 && memcmp(blockList[guidIndex[j - 1]].guid, blockList[i].guid, 16) > 0) {
+            guidIndex[j] = guidIndex[j - 1];
+            j--;
+        }
+        guidIndex[j] = i;
+    }
+}
+
+/*
+ * Map every notify ID to its event block so notifications dispatch without
+ * scanning the block list. As in find(), the first block wins.
+ */
+void WMIBlockTable::buildNotifyIndex() {
+    memset(notifyIndex, 0xff, sizeof(notifyIndex));
+    for (int i = blockCount - 1; i >= 0; i--) {
+        if (blockList[i].flags & ACPI_WMI_EVENT) {
+            notifyIndex[blockList[i].notifyId] = i;
+        }
+    }
+}
+
+WMIBlock* WMIBlockTable::find(const WMIGuid& guid) const {
+    if (!guid.valid) {
+        return nullptr;
+    }
+
+    int low = 0, high = blockCount;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (guid.compare(blockList[guidIndex[mid]].guid) > 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < blockCount && guid.compare(blockList[guidIndex[low]].guid) == 0) {
+        return &blockList[guidIndex[low]];
+    }
+    return nullptr;
+}
+
+int WMIBlockTable::dispatchNotify(WMIDevice* device, UInt8 notifyId, WMIDispatchHooks* hooks) {
+    int index = findNotify(notifyId);
+    bool subscribed = index >= 0 && hasSubscribers(index);
+    if (!subscribed && !(hooks && hooks->wantsEventData(notifyId, index))) {
+        return index;
+    }
+
+    WMIEventData eventData;
+    IOReturn status = getEventData(device, notifyId, &eventData);
+    if (hooks) {
+        hooks->onEventData(notifyId, index, &eventData, status);
+    }
+    if (subscribed && !(hooks && hooks->deferEvent(notifyId, index, &eventData))) {
+        deliverEvent(index, &eventData, hooks);
+    }
+    device->release(&eventData);
+    return index;
+}
+
+void WMIBlockTable::deliverEvent(int index, const WMIEventData* eventData, WMIDispatchHooks* hooks) {
+    WMIBlock* block = getBlock(index);
+    forEachSubscriber(index, [&](WMIEventHandler* handler) {
+        if (hooks) {
+            hooks->callHandler(index, handler, block, eventData);
+        } else {
+            handler->action(handler->target, block, eventData);
+        }
+    });
+}
+
+/*
+ * Event blocks only have WExx, named after the notify ID. Data blocks have
+ * WQxx and WSxx named after the object ID, plus WMxx for methods or WCxx
+ * for the others.
+ */
+bool WMIBlockTable::getMethodName(const WMIBlock* block, WMIMethodKind kind, char name[5]) {
+    static const char* prefixes[] = {"WE", "WC", "WQ", "WS", "WM"};
+    static const char hex[] = "0123456789ABCDEF";
+
+    bool event = block->flags & ACPI_WMI_EVENT;
+    bool method = block->flags & ACPI_WMI_METHOD;
+    switch (kind) {
+        case kWMIMethodEventEnable:
+            if (!event) {
+                return false;
+            }
+            break;
+        case kWMIMethodCollectEnable:
+            if (event || method) {
+                return false;
+            }
+            break;
+        case kWMIMethod:
+            if (event || !method) {
+                return false;
+            }
+            break;
+        default:
+            if (event) {
+                return false;
+            }
+            break;
+    }
+
+    name[0] = prefixes[kind][0];
+    name[1] = prefixes[kind][1];
+    if (event) {
+        name[2] = hex[block->notifyId >> 4];
+        name[3] = hex[block->notifyId & 0xf];
+    } else {
+        name[2] = block->objectId[0];
+        name[3] = block->objectId[1];
+    }
+    name[4] = '\0';
+    return true;
+}
+
+WMISubscriberList* WMIBlockTable::allocSubscribers(int count) {
+    WMISubscriberList* list = (WMISubscriberList*) wmi_alloc(sizeof(WMISubscriberList) + count * sizeof(WMIEventHandler));
+    if (list) {
+        list->nextRetired = nullptr;
+        list->count = count;
+    }
+    return list;
+}
+
+void WMIBlockTable::freeSubscribers(WMISubscriberList* list) {
+    wmi_free(list, sizeof(WMISubscriberList) + list->count * sizeof(WMIEventHandler));
+}
+
+/*
+ * Swap in a new subscriber snapshot, called with registrations serialized
+ * or after dispatch has stopped. The old snapshot may still be walked by a
+ * dispatcher, so it is retired instead of freed.
+ */
+void WMIBlockTable::publishSubscribers(int index, WMISubscriberList* list) {
+    WMISubscriberList* old = __atomic_exchange_n(&subscriberList[index], list, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->nextRetired = retiredSubscribers;
+        retiredSubscribers = old;
+    }
+    reclaimSubscribers(false);
+}
+
+/*
+ * Retired snapshots were unpublished before this point, so once no
+ * dispatcher is running nobody can hold a reference to them anymore.
+ */
+void WMIBlockTable::reclaimSubscribers(bool force) {
+    if (!force && __atomic_load_n(&dispatchReaders, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+    while (WMISubscriberList* list = retiredSubscribers) {
+        retiredSubscribers = list->nextRetired;
+        freeSubscribers(list);
+    }
+}
@@ -0,0 +1,244 @@
+#ifndef WMIBlockTable_hpp
+#define WMIBlockTable_hpp
+
+#include <libkern/OSTypes.h>
+#include <IOKit/IOReturn.h>
+#include <string.h>
+#include "WMIGuid.hpp"
+
+/*
+ * The platform independent part of the controller: _WDG parsing, block
+ * lookup, ACPI method names and event dispatch. It only reaches the ACPI
+ * device through WMIDevice, the environment implements that and the two
+ * allocation hooks below. See Tests/ for the host build.
+ */
+
+/* IOMallocZero and IOFree in the kext */
+void* wmi_alloc(size_t size);
+void wmi_free(void* memory, size_t size);
+
+class OSObject;
+
+/*
+ * If the GUID data block is marked as expensive, we must enable and
+ * explicitily disable data collection.
+ */
+#define ACPI_WMI_EXPENSIVE   0x1
+#define ACPI_WMI_METHOD      0x2    /* GUID is a method */
+#define ACPI_WMI_STRING      0x4    /* GUID takes & returns a string */
+#define ACPI_WMI_EVENT       0x8    /* GUID is an event */
+
+struct WMIBlock {
+    char guid[16];
+    union {
+        char objectId[2];
+        struct {
+            UInt8 notifyId;
+            UInt8 reserved;
+        };
+    };
+    UInt8 instanceCount;
+    UInt8 flags;
+};
+
+/* Buffers and strings up to this size are copied into WMIEventData */
+#define WMI_EVENT_INLINE_SIZE 16
+
+enum WMIEventDataType : UInt8 {
+    kWMIEventDataNone,          /* _WED is missing or failed */
+    kWMIEventDataInteger,
+    kWMIEventDataBuffer,
+    kWMIEventDataString,        /* not NUL terminated */
+    kWMIEventDataPackage,       /* only available through object */
+};
+
+/*
+ * A _WED result decoded once by the controller, so handlers can match it
+ * without casting. Longer buffers and strings point into object, which
+ * like the whole value is only valid during the handler call.
+ */
+struct WMIEventData {
+    WMIEventDataType type;
+    UInt32 length;              /* bytes of a buffer or string, elements of a package */
+    union {
+        UInt64 integer;         /* of a package: its first element if that is an integer, else 0 */
+        UInt8 inlineBytes[WMI_EVENT_INLINE_SIZE];
+        const void* externalBytes;
+    };
+    OSObject* object;           /* the _WED result, nullptr for injected events */
+
+    const void* getBytes() const { return length <= WMI_EVENT_INLINE_SIZE ? inlineBytes : externalBytes; }
+
+    /*
+     * The event code firmware reports in whichever type: an integer as is,
+     * a buffer of up to 8 bytes read little endian, a package by its first
+     * integer element. 0 for anything else.
+     */
+    UInt64 toInteger() const {
+        UInt64 value = 0;
+        switch (type) {
+            case kWMIEventDataInteger:
+            case kWMIEventDataPackage:
+                return integer;
+            case kWMIEventDataBuffer:
+                for (UInt32 i = length; i > 0 && length <= sizeof(UInt64); i--) {
+                    value = value << 8 | inlineBytes[i - 1];
+                }
+                return value;
+            default:
+                return 0;
+        }
+    }
+};
+
+/*
+ * The ACPI device as seen by the core. The kext forwards to its
+ * IOACPIPlatformDevice, host builds use a scripted mock.
+ */
+class WMIDevice {
+ public:
+    /* Evaluate an object with integer arguments, result is kWMIEventDataNone on failure */
+    virtual IOReturn evaluate(const char* name, const UInt32* arguments, int argumentCount, WMIEventData* result) = 0;
+    /* Drop what evaluate() left in result */
+    virtual void release(WMIEventData* result) = 0;
+
+ protected:
+    ~WMIDevice() {}
+};
+
+typedef void (*WMIEventAction)(OSObject* target, WMIBlock* block, const WMIEventData* eventData);
+
+struct WMIEventHandler {
+    OSObject* target;
+    WMIEventAction action;
+};
+
+/*
+ * Immutable snapshot of the subscribers of an event block. Registration
+ * publishes a new snapshot and retires the old one, dispatch never locks.
+ */
+struct WMISubscriberList {
+    WMISubscriberList* nextRetired;
+    int count;
+    WMIEventHandler handlers[];
+};
+
+/*
+ * Optional observer of dispatchNotify. The defaults behave as if there was
+ * none, the kext overrides them for its statistics, capture, logging and
+ * deferred delivery. index is -1 for a notify ID no block has.
+ */
+class WMIDispatchHooks {
+ public:
+    /* Whether to evaluate _WED although the block has no subscribers */
+    virtual bool wantsEventData(UInt8 notifyId, int index) { return false; }
+    /* Called once _WED has been evaluated, before any delivery */
+    virtual void onEventData(UInt8 notifyId, int index, const WMIEventData* eventData, IOReturn status) {}
+    /* Take over delivery to the subscribers, false to call them right away */
+    virtual bool deferEvent(UInt8 notifyId, int index, const WMIEventData* eventData) { return false; }
+    /* Call one subscriber */
+    virtual void callHandler(int index, const WMIEventHandler* handler, WMIBlock* block, const WMIEventData* eventData) {
+        handler->action(handler->target, block, eventData);
+    }
+
+ protected:
+    ~WMIDispatchHooks() {}
+};
+
+/* ACPI methods a block may have */
+enum WMIMethodKind {
+    kWMIMethodEventEnable,      /* WExx */
+    kWMIMethodCollectEnable,    /* WCxx */
+    kWMIMethodQuery,            /* WQxx */
+    kWMIMethodSet,              /* WSxx */
+    kWMIMethod,                 /* WMxx */
+};
+
+class WMIBlockTable {
+    WMIBlock* blockList = nullptr;
+    int blockCount = 0;
+    int* guidIndex = nullptr;   /* block indices sorted by raw GUID */
+    SInt16 notifyIndex[256];    /* notifyId -> event block index, -1 if none */
+
+    WMISubscriberList** subscriberList = nullptr;
+    WMISubscriberList* retiredSubscribers = nullptr;
+    SInt32 dispatchReaders = 0;
+
+    void buildGuidIndex();
+    void buildNotifyIndex();
+
+ public:
+    /* Notifications may arrive before load() and after unload(), they find no block */
+    WMIBlockTable() { memset(notifyIndex, 0xff, sizeof(notifyIndex)); }
+
+    /* Copy and index the raw _WDG buffer, false if it is malformed or memory runs out */
+    bool load(const void* data, UInt32 length);
+    /* Evaluate _WDG on the device and load it */
+    bool load(WMIDevice* device);
+    void unload();
+
+    int getCount() const { return blockCount; }
+    WMIBlock* getBlock(int index) const { return &blockList[index]; }
+    int getIndex(const WMIBlock* block) const { return (int) (block - blockList); }
+
+    WMIBlock* find(const WMIGuid& guid) const;
+    int findNotify(UInt8 notifyId) const { return notifyIndex[notifyId]; }
+
+    /* Call f(index) with the first block of every distinct GUID */
+    template <typename F>
+    void forEachGuid(F f) const {
+        for (int i = 0; i < blockCount; i++) {
+            if (i == 0 || memcmp(blockList[guidIndex[i - 1]].guid, blockList[guidIndex[i]].guid, 16) != 0) {
+                f(guidIndex[i]);
+            }
+        }
+    }
+
+    /* Evaluate _WED, the caller releases eventData through the device */
+    static IOReturn getEventData(WMIDevice* device, UInt8 notifyId, WMIEventData* eventData) {
+        UInt32 argument = notifyId;
+        return device->evaluate("_WED", &argument, 1, eventData);
+    }
+
+    /*
+     * The notification path: evaluate _WED only if the event block has
+     * subscribers or hooks want it, and call the subscribers. Returns the
+     * block index, -1 if no block has this notify ID.
+     */
+    int dispatchNotify(WMIDevice* device, UInt8 notifyId, WMIDispatchHooks* hooks = nullptr);
+
+    /* Call the subscribers of a block, for events dispatchNotify let hooks defer */
+    void deliverEvent(int index, const WMIEventData* eventData, WMIDispatchHooks* hooks = nullptr);
+
+    /* Name of the ACPI method of a block, false if the block has no such method */
+    static bool getMethodName(const WMIBlock* block, WMIMethodKind kind, char name[5]);
+
+    static WMISubscriberList* allocSubscribers(int count);
+    static void freeSubscribers(WMISubscriberList* list);
+
+    /* Current snapshot, only stable while the caller serializes registrations */
+    WMISubscriberList* getSubscribers(int index) const { return subscriberList[index]; }
+    bool hasSubscribers(int index) const {
+        return subscriberList && __atomic_load_n(&subscriberList[index], __ATOMIC_RELAXED) != nullptr;
+    }
+    void publishSubscribers(int index, WMISubscriberList* list);
+    void reclaimSubscribers(bool force);
+
+    /* Whether a dispatcher may still be walking a snapshot published earlier */
+    bool isDispatching() const { return __atomic_load_n(&dispatchReaders, __ATOMIC_SEQ_CST) != 0; }
+
+    /* Call f(handler) for every subscriber of a block, lock free */
+    template <typename F>
+    void forEachSubscriber(int index, F f) {
+        __atomic_add_fetch(&dispatchReaders, 1, __ATOMIC_SEQ_CST);
+        WMISubscriberList* list = subscriberList ? __atomic_load_n(&subscriberList[index], __ATOMIC_SEQ_CST) : nullptr;
+        if (list) {
+            for (int i = 0; i < list->count; i++) {
+                f(&list->handlers[i]);
+            }
+        }
+        __atomic_sub_fetch(&dispatchReaders, 1, __ATOMIC_SEQ_CST);
+    }
+};
+
+#endif /* WMIBlockTable_hpp */
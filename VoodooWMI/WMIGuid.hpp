@@ -0,0 +1,109 @@
+#ifndef WMIGuid_hpp
+#define WMIGuid_hpp
+
+#include <libkern/OSTypes.h>
+#include <libkern/libkern.h>
+#include <string.h>
+
+/*
+ * A GUID in the raw byte order used by _WDG, so it can be compared with
+ * WMIBlock::guid directly. The string form is the usual
+ * "ABBC0F72-8EA1-11D1-00A0-C90629100000", whose first three groups are
+ * stored little endian.
+ */
+struct WMIGuid {
+    UInt8 bytes[16];
+    bool valid;
+
+    static constexpr int hexDigit(char c) {
+        return (c >= '0' && c <= '9') ? c - '0' :
+               (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+               (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    }
+
+    /* Parse the string form, valid is false if it is malformed */
+    static constexpr WMIGuid parse(const char* str) {
+        /* raw byte index of each pair of hex digits in the string */
+        constexpr int order[16] = {3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15};
+        WMIGuid guid = {{0}, false};
+        if (!str) {
+            return guid;
+        }
+        for (int i = 0; i < 16; i++) {
+            if (i == 4 || i == 6 || i == 8 || i == 10) {
+                if (*str++ != '-') {
+                    return guid;
+                }
+            }
+            int high = hexDigit(*str++);
+            if (high < 0) {
+                return guid;
+            }
+            int low = hexDigit(*str++);
+            if (low < 0) {
+                return guid;
+            }
+            guid.bytes[order[i]] = (UInt8) (high << 4 | low);
+        }
+        guid.valid = *str == '\0';
+        return guid;
+    }
+
+    static WMIGuid fromRaw(const char* raw) {
+        WMIGuid guid = {{0}, true};
+        memcpy(guid.bytes, raw, 16);
+        return guid;
+    }
+
+    int compare(const char* raw) const {
+        return memcmp(bytes, raw, 16);
+    }
+};
+
+/*
+ * Convert a raw GUID to the ACII string representation
+ */
+static inline int wmi_gtoa(const char* in, char* out) {
+    int i;
+
+    for (i = 3; i >= 0; i--)
+        out += snprintf(out, 3, "%02X", in[i] & 0xFF);
+
+    out += snprintf(out, 2, "-");
+    out += snprintf(out, 3, "%02X", in[5] & 0xFF);
+    out += snprintf(out, 3, "%02X", in[4] & 0xFF);
+    out += snprintf(out, 2, "-");
+    out += snprintf(out, 3, "%02X", in[7] & 0xFF);
+    out += snprintf(out, 3, "%02X", in[6] & 0xFF);
+    out += snprintf(out, 2, "-");
+    out += snprintf(out, 3, "%02X", in[8] & 0xFF);
+    out += snprintf(out, 3, "%02X", in[9] & 0xFF);
+    out += snprintf(out, 2, "-");
+
+    for (i = 10; i <= 15; i++)
+        out += snprintf(out, 3, "%02X", in[i] & 0xFF);
+
+    return 0;
+}
+
+/* The parsed form of a GUID literal, any use of a malformed one fails to build */
+template <typename Char, Char... chars>
+struct WMIGuidLiteral {
+    static_assert(sizeof(Char) == 1, "_wmiguid takes a narrow string literal");
+    static constexpr char string[] = {chars..., '\0'};
+    static constexpr WMIGuid guid = WMIGuid::parse(string);
+    static_assert(sizeof...(chars) == 36 && guid.valid, "malformed _wmiguid literal");
+};
+
+template <typename Char, Char... chars>
+constexpr char WMIGuidLiteral<Char, chars...>::string[];
+template <typename Char, Char... chars>
+constexpr WMIGuid WMIGuidLiteral<Char, chars...>::guid;
+
+/* "ABBC0F72-8EA1-11D1-00A0-C90629100000"_wmiguid, parsed at compile time */
+template <typename Char, Char... chars>
+constexpr WMIGuid operator"" _wmiguid() {
+    return WMIGuidLiteral<Char, chars...>::guid;
+}
+
+#endif /* WMIGuid_hpp */
@@ -12,6 +12,7 @@
 #import <sys/socket.h>
 #import <dlfcn.h>
 #import <sys/kern_event.h>
+#import <IOKit/IODataQueueClient.h>
 #import "BezelServices.h"
 #import "OSD.h"
 #import "KernelMessage.h"
@@ -122,9 +123,7 @@ int sendMessageToDriver(struct VoodooWMIHotkeyMessage message) {
     return output;
 }
 
-void toggleTouchpad() {
-    struct VoodooWMIHotkeyMessage message = {.type = kActionToggleTouchpad};
-    int result = sendMessageToDriver(message);
+void showTouchpadStatus(int result) {
     if (result != -1) {
         if (result) {
             showOSD(OSDGraphicKeyboardBacklightDisabledMeter, 0, 0);
@@ -134,6 +133,11 @@ void toggleTouchpad() {
     }
 }
 
+void toggleTouchpad() {
+    struct VoodooWMIHotkeyMessage message = {.type = kActionToggleTouchpad};
+    showTouchpadStatus(sendMessageToDriver(message));
+}
+
 OSStatus onHotKeyEvent(EventHandlerCallRef nextHandler, EventRef theEvent, void *userData) {
     EventHotKeyID eventId;
     GetEventParameter(theEvent, kEventParamDirectObject, typeEventHotKeyID, NULL, sizeof(eventId), NULL, &eventId);
@@ -191,6 +195,12 @@ void dispatchMessage(struct VoodooWMIHotkeyMessage *message) {
         case kActionSleep:
         case kActionScreenBrightnessDown:
         case kActionScreenBrightnessUp:
+        case kActionMediaPlayPause:
+        case kActionMediaNextTrack:
+        case kActionMediaPreviousTrack:
+        case kActionVolumeMute:
+        case kActionVolumeDown:
+        case kActionVolumeUp:
             sendMessageToDriver(*message);
             break;
         case kActionLockScreen:
@@ -205,6 +215,9 @@ void dispatchMessage(struct VoodooWMIHotkeyMessage *message) {
         case kActionToggleTouchpad:
             toggleTouchpad();
             break;
+        case kNotifyTouchpadStatus:
+            showTouchpadStatus(message->arg1);
+            break;
         case kActionKeyboardBacklightDown:
             showOSD(OSDGraphicKeyboardBacklightMeter, 0, 0);
             break;
@@ -268,6 +281,67 @@ void kernelMessageLoop() {
     }
 }
 
+io_connect_t openDriver() {
+    // wait for the driver to show up, e.g. while the kext is being reloaded
+    while (YES) {
+        io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("VoodooWMIHotkeyDriver"));
+        if (service != IO_OBJECT_NULL) {
+            io_connect_t connection;
+            kern_return_t ret = IOServiceOpen(service, mach_task_self(), 0, &connection);
+            IOObjectRelease(service);
+            if (ret == KERN_SUCCESS) {
+                return connection;
+            }
+        }
+        sleep(1);
+    }
+}
+
+// returns NO if the driver has no message queue, otherwise runs until the driver goes away
+BOOL messageQueueLoop() {
+    io_connect_t connection = openDriver();
+    mach_port_t port = IODataQueueAllocateNotificationPort();
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+    BOOL mapped = NO;
+    if (port != MACH_PORT_NULL &&
+        IOConnectSetNotificationPort(connection, kClientNotificationMessageQueue, port, 0) == KERN_SUCCESS &&
+        IOConnectMapMemory64(connection, kClientMemoryMessageQueue, mach_task_self(), &address, &size, kIOMapAnywhere) == KERN_SUCCESS) {
+        mapped = YES;
+        printf("VoodooWMIHotkeyDaemon:: receiving messages through the message queue\n");
+
+        // drain every queued message per wakeup, reading them in place
+        IODataQueueMemory *queue = (IODataQueueMemory *)address;
+        BOOL open = YES;
+        while (open && IODataQueueWaitForAvailableData(queue, port) == kIOReturnSuccess) {
+            IODataQueueEntry *entry;
+            while ((entry = IODataQueuePeek(queue)) != NULL) {
+                if (entry->size == sizeof(struct VoodooWMIHotkeyMessage)) {
+                    struct VoodooWMIHotkeyMessage *message = (struct VoodooWMIHotkeyMessage *)entry->data;
+                    if (message->type == kNotifyQueueClosed) {
+                        open = NO;
+                    } else {
+                        dispatchMessage(message);
+                    }
+                }
+                IODataQueueDequeue(queue, NULL, NULL);
+            }
+            // let in what the full queue held back, this fails once the driver is gone
+            if (open && IOConnectCallScalarMethod(connection, kClientSelectorFlushMessages, NULL, 0, NULL, NULL) != KERN_SUCCESS) {
+                open = NO;
+            }
+        }
+        IOConnectUnmapMemory64(connection, kClientMemoryMessageQueue, mach_task_self(), address);
+        printf("VoodooWMIHotkeyDaemon:: message queue closed\n");
+    }
+
+    if (port != MACH_PORT_NULL) {
+        mach_port_destroy(mach_task_self(), port);
+    }
+    IOServiceClose(connection);
+    return mapped;
+}
+
 int main(int argc, const char *argv[]) {
     @autoreleasepool {
         printf("VoodooWMIHotkey:: daemon started...\n");
@@ -279,6 +353,10 @@ int main(int argc, const char *argv[]) {
         registerHotKeys();
 
         dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+            // reconnect whenever the driver comes back, e.g. after a kext reload
+            while (messageQueueLoop()) {
+            }
+            // older drivers only broadcast kernel events
             kernelMessageLoop();
         });
 
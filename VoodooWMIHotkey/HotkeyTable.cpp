@@ -0,0 +1,148 @@
+#include "HotkeyTable.hpp"
+
+static UInt32 hotkeyHash(UInt8 notifyId, UInt32 eventData) {
+    return (eventData ^ (UInt32) notifyId << 24) * 2654435761u;
+}
+
+HotkeyTable* HotkeyTable::create(int entryCount) {
+    UInt32 slotCount = 8;
+    while (slotCount < (UInt32) entryCount * 2) {
+        slotCount <<= 1;
+    }
+
+    HotkeyTable* table = (HotkeyTable*) hotkey_alloc(sizeof(HotkeyTable));
+    if (!table) {
+        return nullptr;
+    }
+    table->slotCount = slotCount;
+    table->predicateCapacity = entryCount;
+    if (!(table->slots = (HotkeySlot*) hotkey_alloc(slotCount * sizeof(HotkeySlot))) ||
+        (entryCount && !(table->predicates = (HotkeyPredicate*) hotkey_alloc(entryCount * sizeof(HotkeyPredicate))))) {
+        free(table);
+        return nullptr;
+    }
+    return table;
+}
+
+void HotkeyTable::free(HotkeyTable* table) {
+    if (!table) {
+        return;
+    }
+    if (table->slots) {
+        hotkey_free(table->slots, table->slotCount * sizeof(HotkeySlot));
+    }
+    if (table->predicates) {
+        hotkey_free(table->predicates, table->predicateCapacity * sizeof(HotkeyPredicate));
+    }
+    hotkey_free(table, sizeof(HotkeyTable));
+}
+
+/* Double the slots, false if memory runs out and the table is left as it was */
+bool HotkeyTable::grow() {
+    UInt32 oldCount = slotCount;
+    HotkeySlot* oldSlots = slots;
+    HotkeySlot* newSlots = (HotkeySlot*) hotkey_alloc(2 * oldCount * sizeof(HotkeySlot));
+    if (!newSlots) {
+        return false;
+    }
+    slots = newSlots;
+    slotCount = 2 * oldCount;
+    for (UInt32 i = 0; i < oldCount; i++) {
+        if (oldSlots[i].used) {
+            UInt32 slot = hotkeyHash(oldSlots[i].notifyId, oldSlots[i].eventData);
+            while (slots[slot & (slotCount - 1)].used) {
+                slot++;
+            }
+            slots[slot & (slotCount - 1)] = oldSlots[i];
+        }
+    }
+    hotkey_free(oldSlots, oldCount * sizeof(HotkeySlot));
+    return true;
+}
+
+bool HotkeyTable::insert(UInt8 notifyId, UInt32 eventData, UInt8 actionId, bool expanded) {
+    if (2 * (exactCount + 1) > slotCount && !grow()) {
+        return false;
+    }
+    // The load factor stays at or below one half, a free slot is always found
+    for (UInt32 slot = hotkeyHash(notifyId, eventData); ; slot++) {
+        HotkeySlot* entry = &slots[slot & (slotCount - 1)];
+        if (!entry->used) {
+            entry->used = true;
+            entry->notifyId = notifyId;
+            entry->eventData = eventData;
+            entry->actionId = actionId;
+            entry->expanded = expanded;
+            exactCount++;
+            return true;
+        }
+        if (entry->notifyId == notifyId && entry->eventData == eventData) {
+            // Exact entries come before ranges whatever the order they were added in
+            if (entry->expanded && !expanded) {
+                entry->actionId = actionId;
+                entry->expanded = false;
+                return true;
+            }
+            return false;
+        }
+    }
+}
+
+bool HotkeyTable::addExact(UInt8 notifyId, UInt32 eventData, UInt8 actionId) {
+    return insert(notifyId, eventData, actionId, false);
+}
+
+bool HotkeyTable::addPredicate(UInt8 notifyId, UInt32 mask, UInt32 first, UInt32 last, UInt8 actionId) {
+    // Expanded values are found before any predicate, so only while none of this notify ID precedes them
+    bool expand = mask == 0xffffffff && first <= last && last - first < HOTKEY_EXPAND_LIMIT;
+    expand = expand && !(predicateNotifyIds[notifyId / 32] & 1u << (notifyId % 32));
+    if (expand) {
+        while (2 * (exactCount + last - first + 1) > slotCount) {
+            if (!grow()) {
+                return false;
+            }
+        }
+        for (UInt32 value = first; ; value++) {
+            insert(notifyId, value, actionId, true);
+            if (value == last) {
+                return true;
+            }
+        }
+    }
+
+    if (predicateCount >= predicateCapacity) {
+        return false;
+    }
+    predicateNotifyIds[notifyId / 32] |= 1u << (notifyId % 32);
+    HotkeyPredicate* predicate = &predicates[predicateCount++];
+    predicate->mask = mask;
+    predicate->first = first;
+    predicate->last = last;
+    predicate->notifyId = notifyId;
+    predicate->actionId = actionId;
+    return true;
+}
+
+UInt8 HotkeyTable::lookup(UInt8 notifyId, UInt32 eventData) const {
+    for (UInt32 slot = hotkeyHash(notifyId, eventData); ; slot++) {
+        const HotkeySlot* entry = &slots[slot & (slotCount - 1)];
+        if (!entry->used) {
+            break;
+        }
+        if (entry->notifyId == notifyId && entry->eventData == eventData) {
+            return entry->actionId;
+        }
+    }
+
+    if (!(predicateNotifyIds[notifyId / 32] & 1u << (notifyId % 32))) {
+        return HOTKEY_NO_ACTION;
+    }
+    for (int i = 0; i < predicateCount; i++) {
+        const HotkeyPredicate* predicate = &predicates[i];
+        UInt32 masked = eventData & predicate->mask;
+        if (predicate->notifyId == notifyId && masked >= predicate->first && masked <= predicate->last) {
+            return predicate->actionId;
+        }
+    }
+    return HOTKEY_NO_ACTION;
+}
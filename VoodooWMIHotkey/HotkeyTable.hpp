@@ -0,0 +1,74 @@
+#ifndef HotkeyTable_hpp
+#define HotkeyTable_hpp
+
+#include <libkern/OSTypes.h>
+#include <stddef.h>
+
+/*
+ * The WMIEvents dispatch table, kept free of IOKit so the trace replayer
+ * can drive the same lookup on a host. The driver provides the two
+ * allocation hooks below.
+ */
+
+/* IOMallocZero and IOFree in the kext */
+void* hotkey_alloc(size_t size);
+void hotkey_free(void* memory, size_t size);
+
+#define HOTKEY_NO_ACTION 0xff
+
+/* Unmasked ranges up to this many values are stored as exact entries */
+#define HOTKEY_EXPAND_LIMIT 64
+
+/* A WMIEvents entry matching one exact event data */
+struct HotkeySlot {
+    UInt32 eventData;
+    UInt8 notifyId;
+    UInt8 actionId;
+    bool used;
+    bool expanded;      /* from a range, an exact entry added later replaces it */
+};
+
+/* A WMIEvents entry matching a family of event data with EventMask and/or EventRange */
+struct HotkeyPredicate {
+    UInt32 mask;
+    UInt32 first;       /* range of the masked event data */
+    UInt32 last;
+    UInt8 notifyId;
+    UInt8 actionId;
+};
+
+/*
+ * WMIEvents compiled for dispatch. Exact entries live in an open addressed
+ * hash keyed by (notifyId, eventData), and so do the values of unmasked
+ * ranges of up to HOTKEY_EXPAND_LIMIT. Lookup is O(1) for those, and so
+ * is a miss on a notify ID without other predicates. Only masked and
+ * wider ranges stay predicates, scanned in order when the hash misses on
+ * their notify ID, so such a miss costs O(predicates).
+ */
+struct HotkeyTable {
+    UInt32 slotCount;   /* power of two, at least twice exactCount */
+    UInt32 exactCount;
+    int predicateCount;
+    int predicateCapacity;
+    HotkeySlot* slots;
+    HotkeyPredicate* predicates;
+    UInt32 predicateNotifyIds[8];   /* bit set for every notify ID having a predicate */
+
+    /* An empty table with room for entryCount entries of either kind */
+    static HotkeyTable* create(int entryCount);
+    static void free(HotkeyTable* table);
+
+    /* false if the key is taken already, the first entry wins */
+    bool addExact(UInt8 notifyId, UInt32 eventData, UInt8 actionId);
+    /* Entries match in the order they were added, exact ones before any predicate */
+    bool addPredicate(UInt8 notifyId, UInt32 mask, UInt32 first, UInt32 last, UInt8 actionId);
+
+    /* The action of an event, HOTKEY_NO_ACTION if none */
+    UInt8 lookup(UInt8 notifyId, UInt32 eventData) const;
+
+ private:
+    bool insert(UInt8 notifyId, UInt32 eventData, UInt8 actionId, bool expanded);
+    bool grow();
+};
+
+#endif /* HotkeyTable_hpp */
@@ -14,6 +14,18 @@ enum WMIHotkeyAction {
     kActionKeyboardBacklightUp,
     kActionScreenBrightnessDown,
     kActionScreenBrightnessUp,
+    kActionMediaPlayPause,
+    kActionMediaNextTrack,
+    kActionMediaPreviousTrack,
+    kActionVolumeMute,
+    kActionVolumeDown,
+    kActionVolumeUp,
+};
+
+/* Messages the driver sends on its own, next to the actions */
+enum WMIHotkeyNotification {
+    kNotifyTouchpadStatus = 0x100,  // arg1: touchpad state after a WMI hotkey toggled it
+    kNotifyQueueClosed,             // last message of the queue, the client was removed or the driver stops
 };
 
 struct VoodooWMIHotkeyMessage {
@@ -24,6 +36,27 @@ struct VoodooWMIHotkeyMessage {
 
 enum IOUserClientSelectorCode {
     kClientSelectorDispatchCommand,
+    kClientSelectorLoadScheme,      // structure input: XML scheme dictionary with WMIEvents, root only
+    kClientSelectorFlushMessages,   // call after draining the queue, moves backlogged messages into it
+};
+
+/*
+ * The message queue is an IODataQueue of VoodooWMIHotkeyMessage entries,
+ * mapped with IOConnectMapMemory and signalled on the port registered with
+ * IOConnectSetNotificationPort. Every client with a registered port gets
+ * every message, messages are broadcast as kernel events only while no
+ * client has registered one. Messages the full queue does not take wait in
+ * a backlog until the client calls kClientSelectorFlushMessages.
+ */
+#define MESSAGE_QUEUE_ENTRIES 64
+#define MESSAGE_BACKLOG_ENTRIES 256
+
+enum IOUserClientMemoryType {
+    kClientMemoryMessageQueue,
+};
+
+enum IOUserClientNotificationType {
+    kClientNotificationMessageQueue,
 };
 
 #endif /* KernelMessage_h */
@@ -0,0 +1,72 @@
+#include "SchemeIndex.hpp"
+
+/* First entry not below guid, or above it if upper */
+static int bound(const SchemeIndexEntry* index, int entryCount, const WMIGuid& guid, bool upper) {
+    int low = 0, high = entryCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int order = memcmp(index[middle].guid, guid.bytes, 16);
+        if (order < 0 || (upper && order == 0)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int findScheme(const SchemeIndexEntry* index, int entryCount, const WMIGuid* guids, int guidCount) {
+    if (!entryCount || !guidCount) {
+        return -1;
+    }
+
+    // The entries of each GUID present, ordered by scheme
+    int* cursor = (int*) hotkey_alloc(2 * guidCount * sizeof(int));
+    if (!cursor) {
+        return -1;
+    }
+    int* end = cursor + guidCount;
+    for (int i = 0; i < guidCount; i++) {
+        cursor[i] = bound(index, entryCount, guids[i], false);
+        end[i] = bound(index, entryCount, guids[i], true);
+    }
+
+    // Merge them by scheme, a scheme matches if every GUID it requires was hit
+    int matched = -1;
+    int best = 0;
+    while (true) {
+        int scheme = -1;
+        for (int i = 0; i < guidCount; i++) {
+            if (cursor[i] < end[i] && (scheme < 0 || index[cursor[i]].scheme < scheme)) {
+                scheme = index[cursor[i]].scheme;
+            }
+        }
+        if (scheme < 0) {
+            break;
+        }
+
+        int hits = 0;
+        int required = 0;
+        for (int i = 0; i < guidCount; i++) {
+            if (cursor[i] < end[i] && index[cursor[i]].scheme == scheme) {
+                required = index[cursor[i]].required;
+                hits++;
+                cursor[i]++;
+            }
+        }
+        if (hits == required && required > best) {
+            best = required;
+            matched = scheme;
+        }
+    }
+
+    hotkey_free(cursor, 2 * guidCount * sizeof(int));
+    return matched;
+}
+
+UInt32 foldSchemeDigest(UInt32 digest, const char* string) {
+    do {
+        digest = (digest ^ (UInt8) *string) * 16777619u;
+    } while (*string++);
+    return digest;
+}
@@ -0,0 +1,40 @@
+#ifndef SchemeIndex_hpp
+#define SchemeIndex_hpp
+
+#include <libkern/OSTypes.h>
+#include "WMIGuid.hpp"
+#include "HotkeyTable.hpp"
+
+/*
+ * The GUIDMatch criteria of every scheme in Platforms, compiled at build
+ * time by Scripts/compile_schemes.py into the SchemeIndex property: one
+ * entry per GUID a scheme requires, sorted by GUID and then scheme. A
+ * scheme matches when all its GUIDs are present. Probing looks up the
+ * GUIDs of the controller and visits only the schemes sharing one, so it
+ * does not grow with the schemes written for other machines.
+ */
+struct SchemeIndexEntry {
+    UInt8 guid[16];     /* raw _WDG byte order */
+    UInt16 scheme;      /* index into SchemeNames, little endian */
+    UInt8 required;     /* GUIDs the scheme requires */
+    UInt8 reserved;
+};
+
+/*
+ * The scheme matched by the sorted, distinct GUIDs of a controller, -1 if
+ * none. Of several matches the one requiring the most GUIDs wins, then the
+ * lowest index. Scratch memory comes from hotkey_alloc.
+ */
+int findScheme(const SchemeIndexEntry* index, int entryCount, const WMIGuid* guids, int guidCount);
+
+/*
+ * FNV-1a digest of the criteria the index was compiled from, stored as
+ * SchemeDigest. Starting at SCHEME_DIGEST_SEED, fold every scheme name in
+ * SchemeNames order, each followed by its GUIDMatch strings as written.
+ * Every string is folded with its terminating NUL.
+ */
+#define SCHEME_DIGEST_SEED 2166136261u
+
+UInt32 foldSchemeDigest(UInt32 digest, const char* string);
+
+#endif /* SchemeIndex_hpp */
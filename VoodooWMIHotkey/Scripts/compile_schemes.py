@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+"""
+Compile the Platforms of VoodooWMIHotkeyDriver into the SchemeIndex,
+SchemeNames and SchemeDigest properties its probe matches against, see
+SchemeIndex.hpp.
+
+    compile_schemes.py Info.plist [output]
+
+Xcode runs it on the built Info.plist. Run it again on the Info.plist of
+an installed kext after editing its Platforms, probe falls back to the
+slow path when the digest no longer matches Platforms.
+"""
+
+import plistlib
+import re
+import struct
+import sys
+
+GUID = re.compile(r'^[0-9A-Fa-f]{8}(-[0-9A-Fa-f]{4}){3}-[0-9A-Fa-f]{12}$')
+
+# raw byte index of each pair of hex digits, as in WMIGuid::parse
+ORDER = [3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15]
+
+# SCHEME_DIGEST_SEED
+DIGEST_SEED = 2166136261
+
+
+class SchemeError(Exception):
+    pass
+
+
+def raw_guid(string):
+    digits = string.replace('-', '')
+    raw = bytearray(16)
+    for pair, index in enumerate(ORDER):
+        raw[index] = int(digits[2 * pair:2 * pair + 2], 16)
+    return bytes(raw)
+
+
+def fold_digest(digest, string):
+    """foldSchemeDigest"""
+    for byte in string.encode('utf-8') + b'\0':
+        digest = ((digest ^ byte) * 16777619) & 0xffffffff
+    return digest
+
+
+def compile_platforms(personality, platforms):
+    """SchemeNames, the packed SchemeIndexEntry array and the digest of one Platforms"""
+    names = sorted(platforms)
+    if len(names) > 0xffff:
+        raise SchemeError('%s: more than 65535 schemes' % personality)
+
+    entries = []
+    digest = DIGEST_SEED
+    for scheme, name in enumerate(names):
+        platform = platforms[name]
+        match = platform.get('GUIDMatch') if isinstance(platform, dict) else None
+        guids = [match] if isinstance(match, str) else match
+        if not isinstance(guids, list) or not guids or len(guids) > 255:
+            raise SchemeError('%s: %s: GUIDMatch must be a GUID or an array of up to 255 GUIDs'
+                              % (personality, name))
+        for guid in guids:
+            if not isinstance(guid, str) or not GUID.match(guid):
+                raise SchemeError('%s: %s: malformed GUID %r' % (personality, name, guid))
+        digest = fold_digest(digest, name)
+        for guid in guids:
+            digest = fold_digest(digest, guid)
+        required = sorted(set(raw_guid(guid) for guid in guids))
+        entries += [(raw, scheme, len(required)) for raw in required]
+
+    entries.sort()
+    index = b''.join(raw + struct.pack('<HBB', scheme, required, 0) for raw, scheme, required in entries)
+    return names, index, digest
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        sys.stderr.write('usage: compile_schemes.py Info.plist [output]\n')
+        return 2
+
+    with open(argv[1], 'rb') as file:
+        plist = plistlib.load(file)
+
+    try:
+        for personality, properties in plist.get('IOKitPersonalities', {}).items():
+            platforms = properties.get('Platforms') if isinstance(properties, dict) else None
+            if not isinstance(platforms, dict):
+                continue
+            names, index, digest = compile_platforms(personality, platforms)
+            properties['SchemeNames'] = names
+            properties['SchemeIndex'] = index
+            properties['SchemeDigest'] = digest
+            print('%s: %d schemes, %d index entries' % (personality, len(names), len(index) // 20))
+    except SchemeError as error:
+        sys.stderr.write('%s: error: %s\n' % (argv[1], error))
+        return 1
+
+    # the kernel only reads XML property lists
+    with open(argv[2] if len(argv) == 3 else argv[1], 'wb') as file:
+        plistlib.dump(plist, file, fmt=plistlib.FMT_XML, sort_keys=False)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
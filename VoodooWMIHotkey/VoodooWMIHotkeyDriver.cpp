@@ -1,5 +1,6 @@
 #include "VoodooWMIHotkeyDriver.hpp"
 #include <IOKit/pwr_mgt/RootDomain.h>
+#include <libkern/libkern.h>
 
 extern "C" {
 #include <sys/kern_event.h>
@@ -8,6 +9,14 @@ extern "C" {
 
 #define DEBUG_LOG(args...) do { if (this->debug) IOLog(args); } while (0)
 
+void* hotkey_alloc(size_t size) {
+    return IOMallocZero(size);
+}
+
+void hotkey_free(void* memory, size_t size) {
+    IOFree(memory, size);
+}
+
 OSDefineMetaClassAndStructors(VoodooWMIHotkeyDriver, IOService)
 OSDefineMetaClassAndStructors(VoodooWMIHotkeyUserClient, IOUserClient)
 
@@ -25,21 +34,121 @@ IOService* VoodooWMIHotkeyDriver::probe(IOService* provider, SInt32* score) {
 
     // Omit info.plist integrity check for the module itself.
     OSDictionary* platforms = OSDynamicCast(OSDictionary, getProperty("Platforms"));
+    const OSSymbol* key = platforms ? matchScheme(platforms) : nullptr;
+    OSDictionary* platform = key ? OSDynamicCast(OSDictionary, platforms->getObject(key)) : nullptr;
+    if (platform) {
+        IOLog("%s::find matched hotkey scheme: %s\n", getName(), key->getCStringNoCopy());
+        eventArray = OSDynamicCast(OSArray, platform->getObject("WMIEvents"));
+        setProperty("Platform", platform);
+        setProperty("PlatformName", const_cast<OSSymbol*>(key));
+        removeProperty("Platforms");
+        removeProperty("SchemeIndex");
+        removeProperty("SchemeNames");
+        removeProperty("SchemeDigest");
+    }
+    OSSafeReleaseNULL(key);
+
+    return platform ? result : nullptr;
+}
+
+/*
+ * Whether names and digest still describe platforms. As many names as
+ * schemes, all of them found, means the same schemes, and the digest
+ * covers their GUIDMatch.
+ */
+static bool isSchemeIndexCurrent(OSDictionary* platforms, OSArray* names, OSNumber* digest) {
+    if (names->getCount() != platforms->getCount()) {
+        return false;
+    }
+
+    UInt32 folded = SCHEME_DIGEST_SEED;
+    for (unsigned i = 0; i < names->getCount(); i++) {
+        OSString* name = OSDynamicCast(OSString, names->getObject(i));
+        OSDictionary* platform = name ? OSDynamicCast(OSDictionary, platforms->getObject(name)) : nullptr;
+        if (!platform) {
+            return false;
+        }
+        folded = foldSchemeDigest(folded, name->getCStringNoCopy());
+
+        OSObject* match = platform->getObject("GUIDMatch");
+        OSArray* array = OSDynamicCast(OSArray, match);
+        int count = array ? array->getCount() : 1;
+        for (int j = 0; j < count; j++) {
+            OSString* guid = OSDynamicCast(OSString, array ? array->getObject(j) : match);
+            if (!guid) {
+                return false;
+            }
+            folded = foldSchemeDigest(folded, guid->getCStringNoCopy());
+        }
+    }
+    return folded == digest->unsigned32BitValue();
+}
+
+/*
+ * Look the GUIDs of the controller up in the SchemeIndex built with the
+ * kext, see SchemeIndex.hpp. Returns a retained key of platforms.
+ */
+const OSSymbol* VoodooWMIHotkeyDriver::matchScheme(OSDictionary* platforms) {
+    OSData* index = OSDynamicCast(OSData, getProperty("SchemeIndex"));
+    OSArray* names = OSDynamicCast(OSArray, getProperty("SchemeNames"));
+    OSNumber* digest = OSDynamicCast(OSNumber, getProperty("SchemeDigest"));
+    if (!index || !names || !digest || index->getLength() % sizeof(SchemeIndexEntry) ||
+        !isSchemeIndexCurrent(platforms, names, digest)) {
+        IOLog("%s::scheme index is missing or stale, run compile_schemes.py on Info.plist\n", getName());
+        return matchSchemeSlow(platforms);
+    }
+
+    int capacity = wmiController->getBlockGuids(nullptr, 0);
+    WMIGuid* guids = capacity ? (WMIGuid*) IOMalloc(capacity * sizeof(WMIGuid)) : nullptr;
+    if (!guids) {
+        return nullptr;
+    }
+    int guidCount = wmiController->getBlockGuids(guids, capacity);
+    if (guidCount > capacity) {
+        guidCount = capacity;
+    }
+    int scheme = findScheme(static_cast<const SchemeIndexEntry*>(index->getBytesNoCopy()),
+                            index->getLength() / sizeof(SchemeIndexEntry), guids, guidCount);
+    IOFree(guids, capacity * sizeof(WMIGuid));
+
+    OSString* name = scheme >= 0 ? OSDynamicCast(OSString, names->getObject(scheme)) : nullptr;
+    return name ? OSSymbol::withString(name) : nullptr;
+}
+
+/*
+ * For a Platforms dictionary edited after the build: ask the controller
+ * about the GUIDMatch of each scheme, a single GUID string or an array of
+ * GUIDs which all have to be present. The scheme requiring the most wins.
+ */
+const OSSymbol* VoodooWMIHotkeyDriver::matchSchemeSlow(OSDictionary* platforms) {
     OSCollectionIterator* iterator = OSCollectionIterator::withCollection(platforms);
+    if (!iterator) {
+        return nullptr;
+    }
+
+    const OSSymbol* matched = nullptr;
+    int best = 0;
     while (OSSymbol* key = OSDynamicCast(OSSymbol, iterator->getNextObject())) {
         OSDictionary* platform = OSDynamicCast(OSDictionary, platforms->getObject(key));
-        if (wmiController->hasGuid(OSDynamicCast(OSString, platform->getObject("GUIDMatch"))->getCStringNoCopy())) {
-            IOLog("%s::find matched hotkey scheme: %s\n", getName(), key->getCStringNoCopy());
-            eventArray = OSDynamicCast(OSArray, platform->getObject("WMIEvents"));
-            OSDictionary* matchedPlatform = OSDictionary::withDictionary(platform);
-            matchedPlatform->setObject("Name", key);
-            setProperty("Platform", matchedPlatform);
-            removeProperty("Platforms");
-            return result;
+        OSObject* match = platform ? platform->getObject("GUIDMatch") : nullptr;
+        OSArray* array = OSDynamicCast(OSArray, match);
+        int count = array ? array->getCount() : (OSDynamicCast(OSString, match) ? 1 : 0);
+        bool present = count > best;
+        for (int i = 0; present && i < count; i++) {
+            OSString* string = OSDynamicCast(OSString, array ? array->getObject(i) : match);
+            present = string && wmiController->hasGuid(string->getCStringNoCopy());
         }
+        if (present) {
+            best = count;
+            matched = key;
+        }
+    }
+    if (matched) {
+        matched->retain();
     }
+    iterator->release();
 
-    return nullptr;
+    return matched;
 }
 
 bool VoodooWMIHotkeyDriver::start(IOService* provider) {
@@ -49,9 +158,55 @@ bool VoodooWMIHotkeyDriver::start(IOService* provider) {
 
     debug = OSDynamicCast(OSBoolean, getProperty("DebugMode"))->getValue();
 
-    // Validate event table
-    for (int i = 0; i < eventArray->getCount(); i++) {
-        OSDictionary* dict = OSDynamicCast(OSDictionary, eventArray->getObject(i));
+    if (!(schemeLock = IOLockAlloc()) || !(messageLock = IOLockAlloc()) || !(messageClients = OSArray::withCapacity(1)) || applyScheme(eventArray) != kIOReturnSuccess) {
+        return false;
+    }
+
+    if (!createKeyboard()) {
+        IOLog("%s::failed to create virtual keyboard, key actions are disabled\n", getName());
+    }
+    if (!startPeerNotifications()) {
+        IOLog("%s::failed to watch peer services, touchpad toggle is disabled\n", getName());
+    }
+
+    registerService();
+
+    return true;
+}
+
+void VoodooWMIHotkeyDriver::onWMIEvent(WMIBlock* block, const WMIEventData* eventData) {
+    UInt32 obtainedEventData = (UInt32) eventData->toInteger();
+    DEBUG_LOG("%s::onWMIEvent (0X%02X, 0X%02X)\n", getName(), block->notifyId, obtainedEventData);
+
+    // Counted until the action is done, so stop() can't tear it down meanwhile
+    __atomic_add_fetch(&dispatchReaders, 1, __ATOMIC_SEQ_CST);
+    HotkeyTable* table = __atomic_load_n(&hotkeyTable, __ATOMIC_SEQ_CST);
+    UInt8 actionId = table ? table->lookup(block->notifyId, obtainedEventData) : HOTKEY_NO_ACTION;
+    if (actionId == kActionToggleTouchpad) {
+        // The daemon did not ask for this toggle, tell it the new state for its OSD
+        int isEnabled = dispatchCommand(actionId);
+        if (isEnabled != -1) {
+            sendMessageToDaemon(kNotifyTouchpadStatus, isEnabled, 0);
+        }
+    } else if (actionId != HOTKEY_NO_ACTION) {
+        dispatchCommand(actionId);
+    }
+    __atomic_sub_fetch(&dispatchReaders, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Build the dispatch table of a WMIEvents array. Invalid entries are logged
+ * and skipped, for duplicated keys the first entry wins.
+ */
+HotkeyTable* VoodooWMIHotkeyDriver::compileHotkeyTable(OSArray* events) {
+    int count = events ? events->getCount() : 0;
+    HotkeyTable* table = HotkeyTable::create(count);
+    if (!table) {
+        return nullptr;
+    }
+
+    for (int i = 0; i < count; i++) {
+        OSDictionary* dict = OSDynamicCast(OSDictionary, events->getObject(i));
         if (!dict) {
             IOLog("%s::failed to parse hotkey event %d", getName(), i);
             continue;
@@ -60,54 +215,266 @@ bool VoodooWMIHotkeyDriver::start(IOService* provider) {
         OSNumber* notifyId = OSDynamicCast(OSNumber, dict->getObject("NotifyID"));
         OSNumber* eventId = OSDynamicCast(OSNumber, dict->getObject("EventData"));
         OSNumber* actionId = OSDynamicCast(OSNumber, dict->getObject("ActionID"));
-        if (!guid || !notifyId || !eventId || !actionId) {
+        OSNumber* eventMask = OSDynamicCast(OSNumber, dict->getObject("EventMask"));
+        OSArray* eventRange = OSDynamicCast(OSArray, dict->getObject("EventRange"));
+        OSNumber* rangeFirst = eventRange ? OSDynamicCast(OSNumber, eventRange->getObject(0)) : nullptr;
+        OSNumber* rangeLast = eventRange ? OSDynamicCast(OSNumber, eventRange->getObject(1)) : nullptr;
+        if (!guid || !notifyId || !actionId || (!eventId && !eventRange) || (eventRange && (!rangeFirst || !rangeLast))) {
             IOLog("%s::failed to parse hotkey event %d", getName(), i);
             continue;
         }
-        wmiController->registerWMIEvent(guid->getCStringNoCopy(), this, OSMemberFunctionCast(WMIEventAction, this, &VoodooWMIHotkeyDriver::onWMIEvent));
+
+        if (eventMask || eventRange) {
+            UInt32 mask = eventMask ? eventMask->unsigned32BitValue() : 0xffffffff;
+            UInt32 first = eventRange ? rangeFirst->unsigned32BitValue() : eventId->unsigned32BitValue() & mask;
+            UInt32 last = eventRange ? rangeLast->unsigned32BitValue() : first;
+            table->addPredicate(notifyId->unsigned8BitValue(), mask, first, last, actionId->unsigned8BitValue());
+        } else if (!table->addExact(notifyId->unsigned8BitValue(), eventId->unsigned32BitValue(), actionId->unsigned8BitValue())) {
+            DEBUG_LOG("%s::duplicated hotkey event %d ignored", getName(), i);
+        }
     }
 
-    registerService();
+    return table;
+}
 
-    return true;
+/*
+ * The distinct GUIDs of a WMIEvents array, so each is registered once no
+ * matter how many keys it carries.
+ */
+OSArray* VoodooWMIHotkeyDriver::copySchemeGuids(OSArray* events) {
+    OSArray* guids = OSArray::withCapacity(4);
+    if (!guids) {
+        return nullptr;
+    }
+    for (int i = 0; events && i < events->getCount(); i++) {
+        OSDictionary* dict = OSDynamicCast(OSDictionary, events->getObject(i));
+        OSString* guid = dict ? OSDynamicCast(OSString, dict->getObject("GUID")) : nullptr;
+        if (!guid) {
+            continue;
+        }
+        bool known = false;
+        for (int j = 0; j < guids->getCount() && !known; j++) {
+            known = guid->isEqualTo(guids->getObject(j));
+        }
+        if (!known) {
+            guids->setObject(guid);
+        }
+    }
+    return guids;
 }
 
-void VoodooWMIHotkeyDriver::onWMIEvent(WMIBlock* block, OSObject* eventData) {
-    int obtainedEventData = 0;
-    if (OSNumber* numberObj = OSDynamicCast(OSNumber, eventData)) {
-        obtainedEventData = numberObj->unsigned32BitValue();
+static bool containsGuid(OSArray* guids, OSString* guid) {
+    for (int i = 0; guids && i < guids->getCount(); i++) {
+        if (guid->isEqualTo(guids->getObject(i))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Compile a WMIEvents array and make it the active scheme. Compilation
+ * happens before the swap, and the table is published before any new GUID
+ * is registered, so every event finds it. Events are only enabled or
+ * disabled for the GUIDs that differ from the previous scheme, so dispatch
+ * is never interrupted.
+ */
+IOReturn VoodooWMIHotkeyDriver::applyScheme(OSArray* events) {
+    HotkeyTable* table = compileHotkeyTable(events);
+    OSArray* guids = copySchemeGuids(events);
+    if (!table || !guids) {
+        HotkeyTable::free(table);
+        OSSafeReleaseNULL(guids);
+        return kIOReturnNoMemory;
     }
-    DEBUG_LOG("%s::onWMIEvent (0X%02X, 0X%02X)\n", getName(), block->notifyId, obtainedEventData);
 
-    for (int i = 0; i < eventArray->getCount(); i++) {
-        OSDictionary* dict = OSDynamicCast(OSDictionary, eventArray->getObject(i));
-        UInt8 notifyId = OSDynamicCast(OSNumber, dict->getObject("NotifyID"))->unsigned8BitValue();
-        int eventData = OSDynamicCast(OSNumber, dict->getObject("EventData"))->unsigned32BitValue();
-        UInt8 actionId = OSDynamicCast(OSNumber, dict->getObject("ActionID"))->unsigned8BitValue();
-        if (block->notifyId == notifyId && obtainedEventData == eventData) {
-            dispatchCommand(actionId);
+    IOLockLock(schemeLock);
+    HotkeyTable* oldTable = __atomic_exchange_n(&hotkeyTable, table, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < guids->getCount(); i++) {
+        OSString* guid = OSDynamicCast(OSString, guids->getObject(i));
+        if (!containsGuid(registeredGuids, guid) &&
+            wmiController->registerWMIEvent(guid->getCStringNoCopy(), this,
+                OSMemberFunctionCast(WMIEventAction, this, &VoodooWMIHotkeyDriver::onWMIEvent)) != kIOReturnSuccess) {
+            IOLog("%s::failed to register %s\n", getName(), guid->getCStringNoCopy());
         }
     }
+    for (int i = 0; registeredGuids && i < registeredGuids->getCount(); i++) {
+        OSString* guid = OSDynamicCast(OSString, registeredGuids->getObject(i));
+        if (!containsGuid(guids, guid)) {
+            wmiController->unregisterWMIEvent(guid->getCStringNoCopy(), this);
+        }
+    }
+    OSSafeReleaseNULL(registeredGuids);
+    registeredGuids = guids;
+    IOLockUnlock(schemeLock);
+
+    retireHotkeyTable(oldTable);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Free a table after it has been swapped out, a dispatcher may still be
+ * looking at it until dispatchReaders drops to zero.
+ */
+void VoodooWMIHotkeyDriver::retireHotkeyTable(HotkeyTable* table) {
+    while (__atomic_load_n(&dispatchReaders, __ATOMIC_SEQ_CST)) {
+        IOSleep(1);
+    }
+    HotkeyTable::free(table);
+}
+
+/*
+ * Load a scheme pushed from userspace: an XML dictionary in the format of
+ * a Platforms entry, passed inline or, when larger, as a memory descriptor.
+ */
+IOReturn VoodooWMIHotkeyDriver::loadScheme(IOMemoryDescriptor* descriptor, const void* bytes, UInt32 length) {
+    if (descriptor) {
+        length = (UInt32) descriptor->getLength();
+    }
+    if (!length) {
+        return kIOReturnBadArgument;
+    }
+
+    char* xml = (char*) IOMalloc(length + 1);
+    if (!xml) {
+        return kIOReturnNoMemory;
+    }
+    if (descriptor) {
+        // the descriptor maps the client's buffer, wire it while copying
+        IOReturn ret = descriptor->prepare();
+        if (ret != kIOReturnSuccess) {
+            IOFree(xml, length + 1);
+            return ret;
+        }
+        IOByteCount copied = descriptor->readBytes(0, xml, length);
+        descriptor->complete();
+        if (copied != length) {
+            IOFree(xml, length + 1);
+            return kIOReturnIOError;
+        }
+    } else {
+        memcpy(xml, bytes, length);
+    }
+    xml[length] = '\0';
+
+    OSString* errorString = nullptr;
+    OSObject* object = OSUnserializeXML(xml, &errorString);
+    IOFree(xml, length + 1);
+
+    IOReturn ret = kIOReturnBadArgument;
+    OSDictionary* scheme = OSDynamicCast(OSDictionary, object);
+    OSArray* events = scheme ? OSDynamicCast(OSArray, scheme->getObject("WMIEvents")) : nullptr;
+    if (!events) {
+        IOLog("%s::invalid hotkey scheme: %s\n", getName(), errorString ? errorString->getCStringNoCopy() : "no WMIEvents");
+    } else if ((ret = applyScheme(events)) == kIOReturnSuccess) {
+        IOLog("%s::loaded hotkey scheme with %d events\n", getName(), events->getCount());
+        setProperty("Platform", scheme);
+    }
+    OSSafeReleaseNULL(errorString);
+    OSSafeReleaseNULL(object);
+
+    return ret;
 }
 
 void VoodooWMIHotkeyDriver::stop(IOService* provider) {
-    for (int i = 0; i < eventArray->getCount(); i++) {
-        OSDictionary* dict = OSDynamicCast(OSDictionary, eventArray->getObject(i));
-        OSString* guid = OSDynamicCast(OSString, dict->getObject("GUID"));
-        wmiController->unregisterWMIEvent(guid->getCStringNoCopy());
+    if (registeredGuids) {
+        for (int i = 0; i < registeredGuids->getCount(); i++) {
+            OSString* guid = OSDynamicCast(OSString, registeredGuids->getObject(i));
+            wmiController->unregisterWMIEvent(guid->getCStringNoCopy(), this);
+        }
+        OSSafeReleaseNULL(registeredGuids);
+    }
+    retireHotkeyTable(__atomic_exchange_n(&hotkeyTable, (HotkeyTable*) nullptr, __ATOMIC_SEQ_CST));
+    if (keyboard) {
+        keyboard->terminate(kIOServiceRequired | kIOServiceSynchronous);
+        OSSafeReleaseNULL(keyboard);
+    }
+    stopPeerNotifications();
+    OSSafeReleaseNULL(messageClients);
+    if (messageLock) {
+        IOLockFree(messageLock);
+        messageLock = nullptr;
+    }
+    if (schemeLock) {
+        IOLockFree(schemeLock);
+        schemeLock = nullptr;
     }
 
     super::stop(provider);
 }
 
+void VoodooWMIHotkeyDriver::addMessageClient(VoodooWMIHotkeyUserClient* client) {
+    if (!messageLock) {
+        return;
+    }
+    IOLockLock(messageLock);
+    if (messageClients->getNextIndexOfObject(client, 0) == (unsigned) -1) {
+        messageClients->setObject(client);
+    }
+    IOLockUnlock(messageLock);
+}
+
+/*
+ * The removed client gets a last message, a client blocked on an empty queue
+ * would not notice otherwise that its driver is going away.
+ */
+void VoodooWMIHotkeyDriver::removeMessageClient(VoodooWMIHotkeyUserClient* client) {
+    if (!messageLock) {
+        return;
+    }
+    IOLockLock(messageLock);
+    unsigned index = messageClients->getNextIndexOfObject(client, 0);
+    if (index != (unsigned) -1) {
+        VoodooWMIHotkeyMessage message = {kNotifyQueueClosed, 0, 0};
+        client->flushBacklog();
+        client->enqueueMessage(&message);
+        messageClients->removeObject(index);
+    }
+    IOLockUnlock(messageLock);
+}
+
+void VoodooWMIHotkeyDriver::flushMessageClient(VoodooWMIHotkeyUserClient* client) {
+    if (!messageLock) {
+        return;
+    }
+    IOLockLock(messageLock);
+    client->flushBacklog();
+    IOLockUnlock(messageLock);
+}
+
+/*
+ * Queue the message for every registered client, each is woken up through
+ * its own port. Only without any client fall back to a kernel event
+ * broadcast, a client whose queue is full keeps the message in its backlog.
+ */
 void VoodooWMIHotkeyDriver::sendMessageToDaemon(int type, int arg1 = 0, int arg2 = 0) {
+    VoodooWMIHotkeyMessage message = {type, arg1, arg2};
+    bool queued = false;
+    UInt32 dropped = 0;
+    if (messageLock) {
+        IOLockLock(messageLock);
+        for (int i = 0; i < messageClients->getCount(); i++) {
+            VoodooWMIHotkeyUserClient* client = OSDynamicCast(VoodooWMIHotkeyUserClient, messageClients->getObject(i));
+            if (!client->enqueueMessage(&message)) {
+                dropped = ++messagesDropped;
+            }
+            queued = true;
+        }
+        IOLockUnlock(messageLock);
+    }
+    if (dropped) {
+        setProperty("MessagesDropped", dropped, 32);
+    }
+    if (queued) {
+        return;
+    }
+
     struct kev_msg kernelEventMsg = {0};
 
-    uint32_t vendorID = 0;
-    if (KERN_SUCCESS != kev_vendor_code_find(KERNEL_EVENT_VENDOR_ID, &vendorID)) {
+    if (!kevVendorCode && KERN_SUCCESS != kev_vendor_code_find(KERNEL_EVENT_VENDOR_ID, &kevVendorCode)) {
         return;
     }
-    kernelEventMsg.vendor_code = vendorID;
+    kernelEventMsg.vendor_code = kevVendorCode;
     kernelEventMsg.event_code = KERNEL_EVENT_CODE;
     kernelEventMsg.kev_class = KEV_ANY_CLASS;
     kernelEventMsg.kev_subclass = KEV_ANY_SUBCLASS;
@@ -122,50 +489,169 @@ void VoodooWMIHotkeyDriver::sendMessageToDaemon(int type, int arg1 = 0, int arg2
     kev_msg_post(&kernelEventMsg);
 }
 
-int8_t VoodooWMIHotkeyDriver::toggleTouchpad() {
-    int8_t isEnabled = -1;
+bool VoodooWMIHotkeyDriver::startPeerNotifications() {
+    if (!(peerLock = IOLockAlloc()) || !(peerServices = OSArray::withCapacity(2))) {
+        return false;
+    }
+
     const OSSymbol* key = OSSymbol::withCString("RM,deliverNotifications");
     OSDictionary* serviceMatch = propertyMatching(key, kOSBooleanTrue);
-    if (OSIterator* iterator = getMatchingServices(serviceMatch)) {
-        while (IOService* candidateService = OSDynamicCast(IOService, iterator->getNextObject())) {
-            candidateService->message(kKeyboardGetTouchStatus, this, &isEnabled);
-            if (isEnabled != -1) {
-                DEBUG_LOG("%s::get touchpad service: %s\n", getName(), candidateService->getMetaClass()->getClassName());
-                isEnabled = !isEnabled;
-                candidateService->message(kKeyboardSetTouchStatus, this, &isEnabled);
-                break;
+    if (serviceMatch) {
+        peerPublishNotifier = addMatchingNotification(gIOPublishNotification, serviceMatch,
+            OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &VoodooWMIHotkeyDriver::onPeerPublished), this);
+        peerTerminateNotifier = addMatchingNotification(gIOTerminatedNotification, serviceMatch,
+            OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &VoodooWMIHotkeyDriver::onPeerTerminated), this);
+        serviceMatch->release();
+    }
+    key->release();
+
+    return peerPublishNotifier && peerTerminateNotifier;
+}
+
+void VoodooWMIHotkeyDriver::stopPeerNotifications() {
+    if (peerPublishNotifier) {
+        peerPublishNotifier->remove();
+        peerPublishNotifier = nullptr;
+    }
+    if (peerTerminateNotifier) {
+        peerTerminateNotifier->remove();
+        peerTerminateNotifier = nullptr;
+    }
+    OSSafeReleaseNULL(touchpadService);
+    OSSafeReleaseNULL(peerServices);
+    if (peerLock) {
+        IOLockFree(peerLock);
+        peerLock = nullptr;
+    }
+}
+
+bool VoodooWMIHotkeyDriver::onPeerPublished(void* refCon, IOService* service, IONotifier* notifier) {
+    IOLockLock(peerLock);
+    if (peerServices->getNextIndexOfObject(service, 0) == (unsigned) -1) {
+        peerServices->setObject(service);
+        DEBUG_LOG("%s::peer service published: %s\n", getName(), service->getMetaClass()->getClassName());
+    }
+    IOLockUnlock(peerLock);
+    return true;
+}
+
+bool VoodooWMIHotkeyDriver::onPeerTerminated(void* refCon, IOService* service, IONotifier* notifier) {
+    IOLockLock(peerLock);
+    unsigned index = peerServices->getNextIndexOfObject(service, 0);
+    if (index != (unsigned) -1) {
+        peerServices->removeObject(index);
+        DEBUG_LOG("%s::peer service terminated: %s\n", getName(), service->getMetaClass()->getClassName());
+    }
+    if (touchpadService == service) {
+        OSSafeReleaseNULL(touchpadService);
+        touchpadEnabled = -1;
+    }
+    IOLockUnlock(peerLock);
+    return true;
+}
+
+/*
+ * Remember the peer answering the touchpad status and the state it was set
+ * to, unless it has been terminated while it was being messaged.
+ */
+void VoodooWMIHotkeyDriver::setTouchpadService(IOService* service, int8_t isEnabled) {
+    IOLockLock(peerLock);
+    if (touchpadService == service) {
+        touchpadEnabled = isEnabled;
+    } else if (peerServices->getNextIndexOfObject(service, 0) != (unsigned) -1) {
+        DEBUG_LOG("%s::get touchpad service: %s\n", getName(), service->getMetaClass()->getClassName());
+        service->retain();
+        OSSafeReleaseNULL(touchpadService);
+        touchpadService = service;
+        touchpadEnabled = isEnabled;
+    }
+    IOLockUnlock(peerLock);
+}
+
+/*
+ * Toggle the touchpad of the first peer answering its status, the cached
+ * one first, so the others are only asked once it stops answering. The
+ * status is asked every time, the touchpad driver may have changed it on
+ * its own. Peers are messaged without peerLock held, the snapshot keeps
+ * them retained meanwhile.
+ */
+int8_t VoodooWMIHotkeyDriver::toggleTouchpad() {
+    if (!peerLock || !peerServices) {
+        return -1;
+    }
+
+    IOLockLock(peerLock);
+    IOService* cachedService = touchpadService;
+    OSArray* candidates = OSArray::withCapacity(peerServices->getCount() + 1);
+    if (candidates) {
+        if (cachedService) {
+            candidates->setObject(cachedService);
+        }
+        for (int i = 0; i < peerServices->getCount(); i++) {
+            if (peerServices->getObject(i) != cachedService) {
+                candidates->setObject(peerServices->getObject(i));
             }
         }
-        iterator->release();
-    } else {
+    }
+    IOLockUnlock(peerLock);
+    if (!candidates) {
+        return -1;
+    }
+
+    int8_t isEnabled = -1;
+    IOService* answered = nullptr;
+    for (int i = 0; i < candidates->getCount() && isEnabled == -1; i++) {
+        IOService* candidateService = OSDynamicCast(IOService, candidates->getObject(i));
+        candidateService->message(kKeyboardGetTouchStatus, this, &isEnabled);
+        if (isEnabled != -1) {
+            isEnabled = !isEnabled;
+            candidateService->message(kKeyboardSetTouchStatus, this, &isEnabled);
+            setTouchpadService(candidateService, isEnabled);
+            answered = candidateService;
+        }
+    }
+    candidates->release();
+
+    if (isEnabled == -1) {
         DEBUG_LOG("%s failed to get touchpad service", getName());
+        IOLockLock(peerLock);
+        touchpadEnabled = -1;
+        IOLockUnlock(peerLock);
+        removeProperty("TouchpadEnabled");
+        return -1;
+    }
+    setProperty("TouchpadEnabled", isEnabled ? kOSBooleanTrue : kOSBooleanFalse);
+    if (answered == cachedService) {
+        setProperty("RegistryWalksAvoided", __atomic_add_fetch(&registryWalksAvoided, 1, __ATOMIC_RELAXED), 32);
     }
-    key->release();
-    serviceMatch->release();
     return isEnabled;
 }
 
-void VoodooWMIHotkeyDriver::adjustBrightness(bool increase) {
-    OSDictionary* serviceMatch = serviceMatching("IOHIDEventService");
-    if (IOService* hidEventService = waitForMatchingService(serviceMatch, 1e9)) {
-        DEBUG_LOG("%s::get HID event service\n", getName());
-
-        const unsigned int DISPATCH_KEY_EVENT_METHOD_INDEX = 281;
-        void** vtable = *(void***)hidEventService;
-        typedef void(*dispatchKeyboardEventMethod)(void* self, AbsoluteTime timeStamp, UInt32 usagePage, UInt32 usage, UInt32 value, IOOptionBits options);
-        dispatchKeyboardEventMethod method = (dispatchKeyboardEventMethod)vtable[DISPATCH_KEY_EVENT_METHOD_INDEX];
-
-        AbsoluteTime timestamp;
-        clock_get_uptime(&timestamp);
-        UInt32 keyCode = increase ? kHIDUsage_KeyboardF15 : kHIDUsage_KeyboardF14;
-        method(hidEventService, timestamp, kHIDPage_KeyboardOrKeypad, keyCode, true, 0);
-        method(hidEventService, timestamp, kHIDPage_KeyboardOrKeypad, keyCode, false, 0);
+bool VoodooWMIHotkeyDriver::createKeyboard() {
+    if (!(keyboard = OSTypeAlloc(VoodooWMIHotkeyKeyboard))) {
+        return false;
+    }
+    if (!keyboard->init() || !keyboard->attach(this)) {
+        OSSafeReleaseNULL(keyboard);
+        return false;
+    }
+    if (!keyboard->start(this)) {
+        keyboard->detach(this);
+        OSSafeReleaseNULL(keyboard);
+        return false;
+    }
+    return true;
+}
 
-        hidEventService->release();
-    } else {
-        DEBUG_LOG("%s failed to get HID event service", getName());
+void VoodooWMIHotkeyDriver::pressKey(UInt32 usagePage, UInt32 usage) {
+    if (!keyboard) {
+        DEBUG_LOG("%s::no virtual keyboard for key 0x%x:0x%x\n", getName(), usagePage, usage);
+        return;
+    }
+    IOReturn ret = keyboard->pressKey(usagePage, usage);
+    if (ret != kIOReturnSuccess) {
+        DEBUG_LOG("%s::failed to post key 0x%x:0x%x (0x%x)\n", getName(), usagePage, usage, ret);
     }
-    serviceMatch->release();
 }
 
 void VoodooWMIHotkeyDriver::sleep() {
@@ -190,10 +676,28 @@ int VoodooWMIHotkeyDriver::dispatchCommand(uint8_t id) {
             return toggleTouchpad();
             break;
         case kActionScreenBrightnessDown:
-            adjustBrightness(false);
+            pressKey(kHIDPage_KeyboardOrKeypad, kHIDUsage_KeyboardF14);
             break;
         case kActionScreenBrightnessUp:
-            adjustBrightness(true);
+            pressKey(kHIDPage_KeyboardOrKeypad, kHIDUsage_KeyboardF15);
+            break;
+        case kActionMediaPlayPause:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_PlayOrPause);
+            break;
+        case kActionMediaNextTrack:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_ScanNextTrack);
+            break;
+        case kActionMediaPreviousTrack:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_ScanPreviousTrack);
+            break;
+        case kActionVolumeMute:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_Mute);
+            break;
+        case kActionVolumeDown:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_VolumeDecrement);
+            break;
+        case kActionVolumeUp:
+            pressKey(kHIDPage_Consumer, kHIDUsage_Csmr_VolumeIncrement);
             break;
         default:
             return -1;
@@ -216,12 +720,120 @@ IOReturn VoodooWMIHotkeyUserClient::externalMethod(uint32_t selector,
         *static_cast<int*>(arguments->structureOutput) = driver->dispatchCommand(input->type);
         return kIOReturnSuccess;
     }
+    if (selector == kClientSelectorFlushMessages) {
+        if (isInactive()) {
+            return kIOReturnNotAttached;
+        }
+        if (!messageQueue) {
+            return kIOReturnNotReady;
+        }
+        driver->flushMessageClient(this);
+        return kIOReturnSuccess;
+    }
+    if (selector == kClientSelectorLoadScheme) {
+        IOReturn ret = clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+        if (ret != kIOReturnSuccess) {
+            return ret;
+        }
+        return driver->loadScheme(arguments->structureInputDescriptor, arguments->structureInput, arguments->structureInputSize);
+    }
     return kIOReturnNotFound;
 }
 
+bool VoodooWMIHotkeyUserClient::allocateMessageQueue() {
+    if (!messageQueue) {
+        messageQueue = IODataQueue::withEntries(MESSAGE_QUEUE_ENTRIES, sizeof(VoodooWMIHotkeyMessage));
+    }
+    return messageQueue != nullptr;
+}
+
+IOReturn VoodooWMIHotkeyUserClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) {
+    if (type != kClientMemoryMessageQueue) {
+        return kIOReturnUnsupported;
+    }
+    if (!allocateMessageQueue()) {
+        return kIOReturnNoMemory;
+    }
+
+    // The client moves the head of the queue, so the mapping stays writable
+    *options = 0;
+    *memory = messageQueue->getMemoryDescriptor();
+    return *memory ? kIOReturnSuccess : kIOReturnNoMemory;
+}
+
+/*
+ * Registering a port adds this client to the receivers of the messages, any
+ * number of clients may listen, like for the kernel event broadcast.
+ */
+IOReturn VoodooWMIHotkeyUserClient::registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon) {
+    VoodooWMIHotkeyDriver* driver = OSDynamicCast(VoodooWMIHotkeyDriver, getProvider());
+    if (!driver) {
+        return kIOReturnError;
+    }
+    if (type != kClientNotificationMessageQueue) {
+        return kIOReturnUnsupported;
+    }
+    if (!allocateMessageQueue()) {
+        return kIOReturnNoMemory;
+    }
+
+    messageQueue->setNotificationPort(port);
+    if (port == MACH_PORT_NULL) {
+        driver->removeMessageClient(this);
+    } else {
+        driver->addMessageClient(this);
+    }
+    return kIOReturnSuccess;
+}
+
+/*
+ * Messages that do not fit in the queue wait in the backlog, in order, until
+ * the client has drained the queue and asks for a flush. Only a client
+ * that stops draining altogether loses messages once the backlog is full.
+ */
+bool VoodooWMIHotkeyUserClient::enqueueMessage(VoodooWMIHotkeyMessage* message) {
+    if (!backlogCount && messageQueue->enqueue(message, sizeof(VoodooWMIHotkeyMessage))) {
+        return true;
+    }
+    if (!backlog && !(backlog = static_cast<VoodooWMIHotkeyMessage*>(IOMalloc(MESSAGE_BACKLOG_ENTRIES * sizeof(VoodooWMIHotkeyMessage))))) {
+        return false;
+    }
+    if (backlogCount == MESSAGE_BACKLOG_ENTRIES) {
+        return false;
+    }
+    backlog[(backlogHead + backlogCount++) % MESSAGE_BACKLOG_ENTRIES] = *message;
+    return true;
+}
+
+void VoodooWMIHotkeyUserClient::flushBacklog() {
+    while (backlogCount && messageQueue->enqueue(&backlog[backlogHead], sizeof(VoodooWMIHotkeyMessage))) {
+        backlogHead = (backlogHead + 1) % MESSAGE_BACKLOG_ENTRIES;
+        backlogCount--;
+    }
+}
+
+void VoodooWMIHotkeyUserClient::stop(IOService* provider) {
+    if (VoodooWMIHotkeyDriver* driver = OSDynamicCast(VoodooWMIHotkeyDriver, provider)) {
+        driver->removeMessageClient(this);
+    }
+    IOUserClient::stop(provider);
+}
+
 IOReturn VoodooWMIHotkeyUserClient::clientClose() {
+    if (VoodooWMIHotkeyDriver* driver = OSDynamicCast(VoodooWMIHotkeyDriver, getProvider())) {
+        driver->removeMessageClient(this);
+    }
     if (!isInactive()) {
         terminate();
     }
     return kIOReturnSuccess;
 }
+
+void VoodooWMIHotkeyUserClient::free() {
+    OSSafeReleaseNULL(messageQueue);
+    if (backlog) {
+        IOFree(backlog, MESSAGE_BACKLOG_ENTRIES * sizeof(VoodooWMIHotkeyMessage));
+        backlog = nullptr;
+    }
+    IOUserClient::free();
+}
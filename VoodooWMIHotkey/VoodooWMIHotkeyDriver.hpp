@@ -2,10 +2,15 @@
 #define __VOODOOWMI_HOTKEY_DRIVER__
 
 #include <IOKit/IOService.h>
-#include <IOKit/hidevent/IOHIDEventService.h>
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IODataQueue.h>
 #include "VoodooWMIController.hpp"
 #include "KernelMessage.h"
+#include "VoodooWMIHotkeyKeyboard.hpp"
+#include "HotkeyTable.hpp"
+#include "SchemeIndex.hpp"
+
+class VoodooWMIHotkeyUserClient;
 
 class VoodooWMIHotkeyDriver : public IOService {
     OSDeclareDefaultStructors(VoodooWMIHotkeyDriver)
@@ -16,6 +21,36 @@ class VoodooWMIHotkeyDriver : public IOService {
     VoodooWMIController* wmiController = nullptr;
     OSArray* eventArray = nullptr;
 
+    /*
+     * The table is swapped atomically on reload. Dispatch counts itself in
+     * dispatchReaders, the replaced table is freed once it drops to zero.
+     */
+    HotkeyTable* hotkeyTable = nullptr;
+    SInt32 dispatchReaders = 0;
+    IOLock* schemeLock = nullptr;       // serializes scheme loads
+    OSArray* registeredGuids = nullptr; // distinct GUIDs of the current scheme
+
+    VoodooWMIHotkeyKeyboard* keyboard = nullptr;
+
+    /*
+     * Services publishing RM,deliverNotifications, the keyboard and touchpad
+     * drivers, tracked by matching notifications so actions never walk the
+     * registry. touchpadService is the peer that answered last.
+     */
+    IOLock* peerLock = nullptr;
+    OSArray* peerServices = nullptr;
+    IOService* touchpadService = nullptr;
+    IONotifier* peerPublishNotifier = nullptr;
+    IONotifier* peerTerminateNotifier = nullptr;
+    int8_t touchpadEnabled = -1;        // state touchpadService last reported and was set to, -1 if unknown, under peerLock
+    UInt32 registryWalksAvoided = 0;    // toggles the cached peer answered
+
+    /* Clients draining a message queue, kernel events are used without any */
+    IOLock* messageLock = nullptr;
+    OSArray* messageClients = nullptr;
+    UInt32 messagesDropped = 0;
+    UInt32 kevVendorCode = 0;
+
     friend class VoodooWMIHotkeyUserClient;
 
  public:
@@ -23,14 +58,32 @@ class VoodooWMIHotkeyDriver : public IOService {
     bool start(IOService* provider) override;
     void stop(IOService* provider) override;
 
-    void onWMIEvent(WMIBlock* block, OSObject* eventData);
+    void onWMIEvent(WMIBlock* block, const WMIEventData* eventData);
 
  private:
+    const OSSymbol* matchScheme(OSDictionary* platforms);
+    const OSSymbol* matchSchemeSlow(OSDictionary* platforms);
+    HotkeyTable* compileHotkeyTable(OSArray* events);
+    static OSArray* copySchemeGuids(OSArray* events);
+    IOReturn applyScheme(OSArray* events);
+    IOReturn loadScheme(IOMemoryDescriptor* descriptor, const void* bytes, UInt32 length);
+    void retireHotkeyTable(HotkeyTable* table);
+
+    void addMessageClient(VoodooWMIHotkeyUserClient* client);
+    void removeMessageClient(VoodooWMIHotkeyUserClient* client);
+    void flushMessageClient(VoodooWMIHotkeyUserClient* client);
     void sendMessageToDaemon(int type, int arg1, int arg2);
     int dispatchCommand(uint8_t id);
 
+    bool startPeerNotifications();
+    void stopPeerNotifications();
+    bool onPeerPublished(void* refCon, IOService* service, IONotifier* notifier);
+    bool onPeerTerminated(void* refCon, IOService* service, IONotifier* notifier);
+    void setTouchpadService(IOService* service, int8_t isEnabled);
+
     int8_t toggleTouchpad();
-    void adjustBrightness(bool increase);
+    bool createKeyboard();
+    void pressKey(UInt32 usagePage, UInt32 usage);
     void sleep();
 
     bool sendKernelMessage(const char *vendorCode, uint32_t eventCode, int arg1, int arg2, int arg3);
@@ -40,11 +93,28 @@ class VoodooWMIHotkeyDriver : public IOService {
 class VoodooWMIHotkeyUserClient : public IOUserClient {
     OSDeclareDefaultStructors(VoodooWMIHotkeyUserClient);
 
+    IODataQueue* messageQueue = nullptr;    // allocated once the client asks for it
+
+    /* Ring of the messages the full queue did not take, allocated on first use */
+    VoodooWMIHotkeyMessage* backlog = nullptr;
+    UInt32 backlogHead = 0;
+    UInt32 backlogCount = 0;
+
+    bool allocateMessageQueue();
+
  public:
     IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
                             IOExternalMethodDispatch* dispatch = 0, OSObject* target = 0, void* reference = 0) override;
+    IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) override;
+    IOReturn registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon) override;
 
+    void stop(IOService* provider) override;
     IOReturn clientClose() override;
+    void free() override;
+
+    /* Called with the messageLock of the driver held, false if the message was dropped */
+    bool enqueueMessage(VoodooWMIHotkeyMessage* message);
+    void flushBacklog();
 };
 
 #endif  // __VOODOOWMI_HOTKEY_DRIVER__
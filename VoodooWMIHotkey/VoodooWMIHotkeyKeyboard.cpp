@@ -0,0 +1,172 @@
+#include "VoodooWMIHotkeyKeyboard.hpp"
+
+OSDefineMetaClassAndStructors(VoodooWMIHotkeyKeyboard, IOHIDDevice)
+
+#define KEYBOARD_REPORT_ID 1
+#define CONSUMER_REPORT_ID 2
+
+/*
+ * Not a USB device, so no assigned IDs. Vendor ID 0 belongs to nobody and
+ * keeps the keyboard from being taken for an Apple one, the product ID
+ * spells "WM".
+ */
+#define KEYBOARD_VENDOR_ID  0x0000
+#define KEYBOARD_PRODUCT_ID 0x574d
+
+/* Boot keyboard layout without LEDs, plus a single consumer control usage */
+static const UInt8 reportDescriptor[] = {
+    0x05, 0x01,         // Usage Page (Generic Desktop)
+    0x09, 0x06,         // Usage (Keyboard)
+    0xa1, 0x01,         // Collection (Application)
+    0x85, KEYBOARD_REPORT_ID,
+    0x05, 0x07,         //   Usage Page (Keyboard)
+    0x19, 0xe0,         //   Usage Minimum (Left Control)
+    0x29, 0xe7,         //   Usage Maximum (Right GUI)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x25, 0x01,         //   Logical Maximum (1)
+    0x75, 0x01,         //   Report Size (1)
+    0x95, 0x08,         //   Report Count (8)
+    0x81, 0x02,         //   Input (Data, Variable, Absolute)
+    0x75, 0x08,         //   Report Size (8)
+    0x95, 0x01,         //   Report Count (1)
+    0x81, 0x01,         //   Input (Constant)
+    0x19, 0x00,         //   Usage Minimum (0)
+    0x2a, 0xff, 0x00,   //   Usage Maximum (255)
+    0x26, 0xff, 0x00,   //   Logical Maximum (255)
+    0x95, 0x06,         //   Report Count (6)
+    0x81, 0x00,         //   Input (Data, Array, Absolute)
+    0xc0,               // End Collection
+    0x05, 0x0c,         // Usage Page (Consumer)
+    0x09, 0x01,         // Usage (Consumer Control)
+    0xa1, 0x01,         // Collection (Application)
+    0x85, CONSUMER_REPORT_ID,
+    0x19, 0x00,         //   Usage Minimum (0)
+    0x2a, 0xff, 0x03,   //   Usage Maximum (1023)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x26, 0xff, 0x03,   //   Logical Maximum (1023)
+    0x75, 0x10,         //   Report Size (16)
+    0x95, 0x01,         //   Report Count (1)
+    0x81, 0x00,         //   Input (Data, Array, Absolute)
+    0xc0,               // End Collection
+};
+
+struct __attribute__((packed)) KeyboardReport {
+    UInt8 reportId;
+    UInt8 modifiers;
+    UInt8 reserved;
+    UInt8 keys[6];
+};
+
+struct __attribute__((packed)) ConsumerReport {
+    UInt8 reportId;
+    UInt16 usage;
+};
+
+bool VoodooWMIHotkeyKeyboard::handleStart(IOService* provider) {
+    if (!super::handleStart(provider)) {
+        return false;
+    }
+
+    report = IOBufferMemoryDescriptor::withCapacity(sizeof(KeyboardReport), kIODirectionNone);
+    reportLock = IOLockAlloc();
+    return report && reportLock;
+}
+
+/*
+ * The report goes under reportLock, so a racing pressKey either finishes
+ * first or finds it gone. The lock itself lives until free().
+ */
+void VoodooWMIHotkeyKeyboard::handleStop(IOService* provider) {
+    if (reportLock) {
+        IOLockLock(reportLock);
+        OSSafeReleaseNULL(report);
+        IOLockUnlock(reportLock);
+    }
+
+    super::handleStop(provider);
+}
+
+void VoodooWMIHotkeyKeyboard::free() {
+    OSSafeReleaseNULL(report);
+    if (reportLock) {
+        IOLockFree(reportLock);
+        reportLock = nullptr;
+    }
+    super::free();
+}
+
+IOReturn VoodooWMIHotkeyKeyboard::newReportDescriptor(IOMemoryDescriptor** descriptor) const {
+    IOBufferMemoryDescriptor* buffer = IOBufferMemoryDescriptor::withBytes(reportDescriptor, sizeof(reportDescriptor), kIODirectionNone);
+    if (!buffer) {
+        return kIOReturnNoMemory;
+    }
+    *descriptor = buffer;
+    return kIOReturnSuccess;
+}
+
+OSString* VoodooWMIHotkeyKeyboard::newTransportString() const {
+    return OSString::withCString("Virtual");
+}
+
+OSString* VoodooWMIHotkeyKeyboard::newManufacturerString() const {
+    return OSString::withCString("VoodooWMI");
+}
+
+OSString* VoodooWMIHotkeyKeyboard::newProductString() const {
+    return OSString::withCString("WMI Hotkey Keyboard");
+}
+
+OSNumber* VoodooWMIHotkeyKeyboard::newVendorIDNumber() const {
+    return OSNumber::withNumber(KEYBOARD_VENDOR_ID, 32);
+}
+
+OSNumber* VoodooWMIHotkeyKeyboard::newProductIDNumber() const {
+    return OSNumber::withNumber(KEYBOARD_PRODUCT_ID, 32);
+}
+
+/*
+ * Fill the shared report buffer, usage 0 releases every key. Called with
+ * reportLock held.
+ */
+IOReturn VoodooWMIHotkeyKeyboard::postReport(UInt8 reportId, UInt32 usage) {
+    UInt8* bytes = static_cast<UInt8*>(report->getBytesNoCopy());
+    if (reportId == KEYBOARD_REPORT_ID) {
+        KeyboardReport* keyboard = reinterpret_cast<KeyboardReport*>(bytes);
+        memset(keyboard, 0, sizeof(KeyboardReport));
+        keyboard->reportId = reportId;
+        if (usage >= kHIDUsage_KeyboardLeftControl && usage <= kHIDUsage_KeyboardRightGUI) {
+            keyboard->modifiers = 1 << (usage - kHIDUsage_KeyboardLeftControl);
+        } else {
+            keyboard->keys[0] = usage;
+        }
+        report->setLength(sizeof(KeyboardReport));
+    } else {
+        ConsumerReport* consumer = reinterpret_cast<ConsumerReport*>(bytes);
+        consumer->reportId = reportId;
+        consumer->usage = OSSwapHostToLittleInt16(usage);
+        report->setLength(sizeof(ConsumerReport));
+    }
+    return handleReport(report);
+}
+
+IOReturn VoodooWMIHotkeyKeyboard::pressKey(UInt32 usagePage, UInt32 usage) {
+    UInt8 reportId;
+    if (usagePage == kHIDPage_KeyboardOrKeypad && usage <= 0xff) {
+        reportId = KEYBOARD_REPORT_ID;
+    } else if (usagePage == kHIDPage_Consumer && usage <= 0x3ff) {
+        reportId = CONSUMER_REPORT_ID;
+    } else {
+        return kIOReturnBadArgument;
+    }
+    if (!reportLock) {
+        return kIOReturnNotReady;
+    }
+
+    IOLockLock(reportLock);
+    IOReturn ret = report ? postReport(reportId, usage) : kIOReturnNotReady;
+    if (ret == kIOReturnSuccess) {
+        ret = postReport(reportId, 0);
+    }
+    IOLockUnlock(reportLock);
+    return ret;
+}
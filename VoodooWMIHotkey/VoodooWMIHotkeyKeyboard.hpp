@@ -0,0 +1,38 @@
+#ifndef VoodooWMIHotkeyKeyboard_hpp
+#define VoodooWMIHotkeyKeyboard_hpp
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/hid/IOHIDDevice.h>
+#include <IOKit/hid/IOHIDUsageTables.h>
+
+/*
+ * A virtual keyboard owned by the hotkey driver, so actions emitting keys
+ * post them as HID reports without looking up another keyboard driver.
+ */
+class VoodooWMIHotkeyKeyboard : public IOHIDDevice {
+    OSDeclareDefaultStructors(VoodooWMIHotkeyKeyboard)
+
+    using super = IOHIDDevice;
+
+    IOBufferMemoryDescriptor* report = nullptr;
+    IOLock* reportLock = nullptr;   // serializes the press and release reports with handleStop
+
+    IOReturn postReport(UInt8 reportId, UInt32 usage);
+
+ public:
+    bool handleStart(IOService* provider) override;
+    void handleStop(IOService* provider) override;
+    void free() override;
+
+    IOReturn newReportDescriptor(IOMemoryDescriptor** descriptor) const override;
+    OSString* newTransportString() const override;
+    OSString* newManufacturerString() const override;
+    OSString* newProductString() const override;
+    OSNumber* newVendorIDNumber() const override;
+    OSNumber* newProductIDNumber() const override;
+
+    /* Press and release a key of the keyboard or consumer usage page */
+    IOReturn pressKey(UInt32 usagePage, UInt32 usage);
+};
+
+#endif /* VoodooWMIHotkeyKeyboard_hpp */